@@ -1,4 +1,5 @@
 #include <cassert>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <iostream>
@@ -317,6 +318,7 @@ void genLogicalAnd(CodeGenCtx& ctx, ASTExpr* lhsExpr, ASTExpr* rhsExpr);
 void genLogicalOr(CodeGenCtx& ctx, ASTExpr* lhsExpr, ASTExpr* rhsExpr);
 void genObjExpr(CodeGenCtx& ctx, ASTExpr* protoExpr, ObjectExpr* objExpr);
 void genAssign(CodeGenCtx& ctx, ASTExpr* lhsExpr, ASTExpr* rhsExpr);
+void findIRNoValueOps(ASTStmt* stmt);
 
 /**
 Generate code for a code unit
@@ -332,6 +334,9 @@ std::string genUnit(FunExpr* unitAST)
     // Register the variable declarations
     registerDecls(unitFun, unitAST->body, true);
 
+    // The runtime library lists the IR ops which push no value
+    findIRNoValueOps(unitAST->body);
+
     // Create the initial context
     CodeGenCtx ctx(
         out,
@@ -379,6 +384,68 @@ void runtimeCall(CodeGenCtx& ctx, std::string funName, size_t numArgs)
     ctx.merge(contBlock);
 }
 
+/**
+Generate a read of a property of the value on top of the stack.
+Objects take a fast path where the VM walks the prototype chain.
+Other values, and objects for which get_prop finds nothing, go
+through the runtime library, which reports missing properties.
+*/
+void genGetProp(CodeGenCtx& ctx, std::string propName)
+{
+    auto joinBlock = new Block();
+
+    auto slowBlock = new Block();
+    auto slowCtx = ctx.subCtx(slowBlock);
+    slowCtx.addStr("op:'push', val:'" + propName + "'");
+    runtimeCall(slowCtx, "getProp", 2);
+    slowCtx.addBranch("jump", "to", joinBlock);
+
+    // get_prop pushes a flag telling if the property was found
+    auto objBlock = new Block();
+    auto objCtx = ctx.subCtx(objBlock);
+    objCtx.addStr("op:'push', val:'" + propName + "'");
+    objCtx.addOp("get_prop");
+    objCtx.addBranch("if_true", "then", joinBlock, "else", slowBlock);
+
+    ctx.addStr("op:'dup', idx:0");
+    ctx.addStr("op:'has_tag', tag:'object'");
+    ctx.addBranch("if_true", "then", objBlock, "else", slowBlock);
+
+    ctx.merge(joinBlock);
+}
+
+/// Inline IR ops which push no value, read from the
+/// rt_irNoValue table of the runtime library
+std::vector<std::string> irNoValueOps;
+
+/// Find the rt_irNoValue table among the top-level declarations
+void findIRNoValueOps(ASTStmt* stmt)
+{
+    if (auto blockStmt = dynamic_cast<BlockStmt*>(stmt))
+    {
+        for (auto subStmt : blockStmt->stmts)
+            findIRNoValueOps(subStmt);
+        return;
+    }
+
+    auto varStmt = dynamic_cast<VarStmt*>(stmt);
+    if (varStmt && varStmt->identName == "rt_irNoValue")
+    {
+        if (auto objExpr = dynamic_cast<ObjectExpr*>(varStmt->initExpr))
+            irNoValueOps = objExpr->names;
+    }
+}
+
+/// Check if an inline IR expression leaves a value on the stack
+bool irProducesValue(IRExpr* irExpr)
+{
+    return std::find(
+        irNoValueOps.begin(),
+        irNoValueOps.end(),
+        irExpr->opName
+    ) == irNoValueOps.end();
+}
+
 void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
 {
     if (auto intExpr = dynamic_cast<IntExpr*>(expr))
@@ -612,9 +679,8 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
             auto identExpr = dynamic_cast<IdentExpr*>(binOp->rhsExpr);
             if (!identExpr)
                 throw ParseError("invalid rhs in member expression");
-            ctx.addStr("op:'push', val:'" + identExpr->name + "'");
 
-            runtimeCall(ctx, "getProp", 2);
+            genGetProp(ctx, identExpr->name);
             return;
         }
 
@@ -751,11 +817,8 @@ void genExpr(CodeGenCtx& ctx, ASTExpr* expr)
         // Duplicate the base (this) value
         ctx.addStr("op:'dup', idx:" + std::to_string(args.size()));
 
-        // Push the property name
-        ctx.addStr("op:'push', val:'" + callExpr->nameStr + "'");
-
         // Get the function/method value
-        runtimeCall(ctx, "getProp", 2);
+        genGetProp(ctx, callExpr->nameStr);
 
         auto contBlock = new Block();
         ctx.addBranch(
@@ -837,7 +900,12 @@ void genStmt(CodeGenCtx& ctx, ASTStmt* stmt)
     if (auto exprStmt = dynamic_cast<ExprStmt*>(stmt))
     {
         genExpr(ctx, exprStmt->expr);
-        ctx.addOp("pop");
+
+        // Pop (ignore) the value produced by the expression, if any
+        auto irExpr = dynamic_cast<IRExpr*>(exprStmt->expr);
+        if (!irExpr || irProducesValue(irExpr))
+            ctx.addOp("pop");
+
         return;
     }
 
@@ -901,6 +969,7 @@ void genStmt(CodeGenCtx& ctx, ASTStmt* stmt)
             bodyCtx.addBranch("jump", "to", incrBlock);
         auto incrCtx = ctx.subCtx(incrBlock);
         genExpr(incrCtx, forStmt->incrExpr);
+        incrCtx.addOp("pop");
         incrCtx.addBranch("jump", "to", testBlock);
 
         ctx.merge(exitBlock);
@@ -982,40 +1051,28 @@ void genObjExpr(CodeGenCtx& ctx, ASTExpr* protoExpr, ObjectExpr* objExpr)
 {
     assert (objExpr->names.size() == objExpr->exprs.size());
 
-    // Create a new object
-    ctx.addStr("op:'push', val:" + std::to_string(objExpr->exprs.size()));
-    ctx.addOp("new_object");
+    // List of field names, in the order the values are pushed
+    std::string fieldsStr;
 
-    // If a prototype expression is specified
+    // If a prototype expression is specified, it is evaluated first
     if (protoExpr)
     {
-        // Duplicate the object value
-        ctx.addStr("op:'dup', idx:0");
-
-        // Push the prototype property name
-        ctx.addPush("'proto'");
-
-        // Evaluate the prototype expression
         genExpr(ctx, protoExpr);
-
-        // Set the prototype field
-        ctx.addOp("set_field");
+        fieldsStr += "'proto'";
     }
 
-    // For each property
+    // Evaluate the property value expressions
     for (size_t i = 0; i < objExpr->names.size(); ++i)
     {
-        // Duplicate the object value
-        ctx.addStr("op:'dup', idx:0");
-
-        // Push the property name
-        ctx.addStr("op:'push', val:'" + objExpr->names[i] + "'");
-
-        // Evaluate the property value expression
         genExpr(ctx, objExpr->exprs[i]);
 
-        ctx.addOp("set_field");
+        if (fieldsStr != "")
+            fieldsStr += ", ";
+        fieldsStr += "'" + objExpr->names[i] + "'";
     }
+
+    // Allocate the object, populated with the values on the stack
+    ctx.addStr("op:'new_object_lit', fields:[" + fieldsStr + "]");
 }
 
 void genAssign(CodeGenCtx& ctx, ASTExpr* lhsExpr, ASTExpr* rhsExpr)
@@ -129,6 +129,57 @@ Value get_core_io_pkg()
     return exports;
 }
 
+//============================================================================
+// core/vm package
+//============================================================================
+
+/// Make an object holding allocation counts and sizes
+Value allocStatsObj(const VM::AllocStats& stats)
+{
+    auto obj = Object::newObject(2);
+    obj.setField("count", Value((int64_t)stats.count));
+    obj.setField("bytes", Value((int64_t)stats.bytes));
+    return obj;
+}
+
+/// Get a snapshot of the heap statistics
+Value heap_stats()
+{
+    auto obj = Object::newObject(16);
+    obj.setField("allocated", Value((int64_t)vm.allocated()));
+    obj.setField("heap_size", Value((int64_t)vm.heapSize()));
+    obj.setField("peak_size", Value((int64_t)vm.peakHeapSize()));
+    obj.setField("num_collections", Value((int64_t)vm.getNumCollections()));
+
+    obj.setField("string", allocStatsObj(vm.getTagStats(TAG_STRING)));
+    obj.setField("array", allocStatsObj(vm.getTagStats(TAG_ARRAY)));
+    obj.setField("object", allocStatsObj(vm.getTagStats(TAG_OBJECT)));
+    obj.setField("imgref", allocStatsObj(vm.getTagStats(TAG_IMGREF)));
+    obj.setField("buffers", allocStatsObj(vm.getBufferStats()));
+
+    // The last bucket has no size limit
+    auto buckets = Array(VM::NUM_SIZE_BUCKETS);
+    for (size_t i = 0; i < VM::NUM_SIZE_BUCKETS; ++i)
+    {
+        auto bucket = Object(allocStatsObj(vm.getSizeStats(i)));
+        if (i + 1 < VM::NUM_SIZE_BUCKETS)
+            bucket.setField("max_size", Value((int64_t)VM::sizeBucketLimit(i)));
+        else
+            bucket.setField("max_size", Value::FALSE);
+        buckets.push(bucket);
+    }
+    obj.setField("size_buckets", buckets);
+
+    return obj;
+}
+
+Value get_core_vm_pkg()
+{
+    auto exports = Object::newObject(4);
+    setHostFn(exports, "heap_stats", 0, (void*)heap_stats);
+    return exports;
+}
+
 //============================================================================
 // core/window package
 //============================================================================
@@ -262,9 +313,19 @@ Value get_core_window_pkg()
 
 //============================================================================
 
-// Cache of loaded packages
+// Cache of loaded packages. The entries are GC roots, which
+// is possible because map entries never move.
 std::unordered_map<std::string, Value> pkgCache;
 
+/// Add a package to the package cache
+Value& cachePkg(std::string pkgName, Value pkg)
+{
+    auto& entry = pkgCache[pkgName];
+    entry = pkg;
+    vm.addRoot(&entry);
+    return entry;
+}
+
 /// Load a package based on its path
 Object load(std::string pkgPath)
 {
@@ -349,6 +410,8 @@ Value getCorePkg(std::string pkgName)
     // Internal/core packages
     if (pkgName == "core/io")
         return get_core_io_pkg();
+    if (pkgName == "core/vm")
+        return get_core_vm_pkg();
     if (pkgName == "core/window")
         return get_core_window_pkg();
 
@@ -382,22 +445,22 @@ Value import(std::string pkgName)
         auto pkg = load(pkgPath);
 
         // Cache the package
-        pkgCache[pkgName] = pkg;
+        auto& entry = cachePkg(pkgName, pkg);
 
-        // Initialize the package
+        // Initialize the package, which may move it
         if (pkg.hasField("init"))
         {
             callExportFn(pkg, "init");
         }
 
-        return pkg;
+        return entry;
     }
 
     // If we can find a core package for this name
     auto corePkg = getCorePkg(pkgName);
     if (corePkg != Value::UNDEF)
     {
-        pkgCache[pkgName] = corePkg;
+        cachePkg(pkgName, corePkg);
         return corePkg;
     }
 
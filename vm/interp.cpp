@@ -1,26 +1,40 @@
+#include <algorithm>
 #include <cassert>
+#include <exception>
 #include <iostream>
+#include <map>
 #include <unordered_map>
 #include "runtime.h"
 #include "parser.h"
 #include "interp.h"
 #include "core.h"
 
+// The JIT compiler generates x86-64 code. Define NO_JIT to build
+// with the interpreter only.
+#if defined(__x86_64__) && !defined(NO_JIT)
+#define HAVE_JIT
+#include <sys/mman.h>
+#endif
+
+/// Number of field lookups performed through named ICache objects
+size_t namedLookupCount = 0;
+
 /// Inline cache to speed up property lookups
 class ICache
 {
 private:
 
-    // Cached slot index
-    size_t slotIdx = 0;
+    // Cached shape and slot index
+    FieldCache cache;
 
-    // Field name to look up
-    std::string fieldName;
+    // Field name to look up, interned so that the cache entries
+    // are keyed on the same name pointer as those of other sites
+    String fieldName;
 
 public:
 
     ICache(std::string fieldName)
-    : fieldName(fieldName)
+    : fieldName(String::internPinned(String(fieldName)))
     {
     }
 
@@ -28,9 +42,13 @@ public:
     {
         Value val;
 
-        if (!obj.getField(fieldName.c_str(), val, slotIdx))
+        namedLookupCount++;
+
+        if (!obj.getField(fieldName, val, cache))
         {
-            throw RunError("missing field \"" + fieldName + "\"");
+            throw RunError(
+                "missing field \"" + (std::string)fieldName + "\""
+            );
         }
 
         return val;
@@ -65,14 +83,38 @@ public:
     }
 };
 
-std::string posToString(Value srcPos)
+/**
+Source position of an instruction, given by an index into the source
+position table of its function. The table is an array holding the
+source name, followed by a line number delta and a column number for
+each position, in order. Positions are only decoded when needed.
+*/
+struct SrcPos
+{
+    /// Position table of the function, null if there is none
+    refptr table = nullptr;
+
+    /// Index of the position in the table, negative if there is none
+    int64_t idx = -1;
+
+    bool isValid() const { return table && idx >= 0; }
+};
+
+std::string posToString(SrcPos srcPos)
 {
-    assert (srcPos.isObject());
-    auto srcPosObj = (Object)srcPos;
+    assert (srcPos.isValid());
+    auto table = Array(Value(srcPos.table, TAG_ARRAY));
+
+    if (table.length() < 2 * srcPos.idx + 3)
+        throw RunError("invalid source position index");
+
+    auto srcName = (std::string)table.getElem(0);
 
-    auto lineNo = (int64_t)srcPosObj.getField("line_no");
-    auto colNo = (int64_t)srcPosObj.getField("col_no");
-    auto srcName = (std::string)srcPosObj.getField("src_name");
+    // Sum the line number deltas up to this position
+    int64_t lineNo = 0;
+    for (int64_t i = 0; i <= srcPos.idx; ++i)
+        lineNo += (int64_t)table.getElem(2 * i + 1);
+    auto colNo = (int64_t)table.getElem(2 * srcPos.idx + 2);
 
     return (
         srcName + "@" +
@@ -116,6 +158,8 @@ enum Opcode : uint16_t
     SET_FIELD,
     GET_FIELD,
     EQ_OBJ,
+    GET_PROP,
+    NEW_OBJECT_LIT,
 
     // Miscellaneous
     EQ_BOOL,
@@ -139,11 +183,31 @@ enum Opcode : uint16_t
     RET,
 
     IMPORT,
-    ABORT
+    ABORT,
+
+    // Superinstructions, produced by fusing common instruction
+    // sequences, with the operands of each instruction inline
+    GET_LOCAL2,         // get_local; get_local
+    GET_LOCAL_PUSH,     // get_local; push
+    GET_FIELD_IMM,      // push obj; push name; get_field
+    CALL_IMM,           // push callee; call
+    IF_LOCAL_HAS_TAG,   // get_local; has_tag; if_true
+    IF_LT_I64,          // lt_i64; if_true
+
+    // Execution count update, only emitted when profiling
+    PROFILE_OP,
+
+    // Number of opcodes (not an instruction)
+    NUM_OPCODES
 };
 
-/// Map from pointers to instruction objects to opcodes
-std::unordered_map<refptr, Opcode> opCache;
+// Define THREADED_DISPATCH to use direct-threaded dispatch on GCC and
+// Clang, where the code heap stores instruction handler addresses
+// (labels-as-values) instead of opcodes. The portable switch is the
+// default, since it currently measures faster with GCC on x86-64.
+#if defined(THREADED_DISPATCH) && !defined(__GNUC__)
+#undef THREADED_DISPATCH
+#endif
 
 /// Total count of instructions executed
 size_t cycleCount = 0;
@@ -151,804 +215,3438 @@ size_t cycleCount = 0;
 /// Cache of all possible one-character string values
 Value charStrings[256];
 
-Opcode decode(Object instr)
+/// Get the name of an opcode, as used in images
+std::string opToStr(Opcode op)
 {
-    auto instrPtr = (refptr)instr;
+    switch (op)
+    {
+        case GET_LOCAL: return "get_local";
+        case SET_LOCAL: return "set_local";
+        case PUSH: return "push";
+        case POP: return "pop";
+        case DUP: return "dup";
+        case SWAP: return "swap";
+        case ADD_I64: return "add_i64";
+        case SUB_I64: return "sub_i64";
+        case MUL_I64: return "mul_i64";
+        case LT_I64: return "lt_i64";
+        case LE_I64: return "le_i64";
+        case GT_I64: return "gt_i64";
+        case GE_I64: return "ge_i64";
+        case EQ_I64: return "eq_i64";
+        case STR_LEN: return "str_len";
+        case GET_CHAR: return "get_char";
+        case GET_CHAR_CODE: return "get_char_code";
+        case STR_CAT: return "str_cat";
+        case EQ_STR: return "eq_str";
+        case NEW_OBJECT: return "new_object";
+        case HAS_FIELD: return "has_field";
+        case SET_FIELD: return "set_field";
+        case GET_FIELD: return "get_field";
+        case EQ_OBJ: return "eq_obj";
+        case GET_PROP: return "get_prop";
+        case NEW_OBJECT_LIT: return "new_object_lit";
+        case EQ_BOOL: return "eq_bool";
+        case HAS_TAG: return "has_tag";
+        case GET_TAG: return "get_tag";
+        case NEW_ARRAY: return "new_array";
+        case ARRAY_LEN: return "array_len";
+        case ARRAY_PUSH: return "array_push";
+        case GET_ELEM: return "get_elem";
+        case SET_ELEM: return "set_elem";
+        case JUMP: return "jump";
+        case JUMP_STUB: return "jump_stub";
+        case IF_TRUE: return "if_true";
+        case IF_TRUE_STUB: return "if_true_stub";
+        case CALL: return "call";
+        case RET: return "ret";
+        case IMPORT: return "import";
+        case ABORT: return "abort";
+        case GET_LOCAL2: return "get_local2";
+        case GET_LOCAL_PUSH: return "get_local_push";
+        case GET_FIELD_IMM: return "get_field_imm";
+        case CALL_IMM: return "call_imm";
+        case IF_LOCAL_HAS_TAG: return "if_local_has_tag";
+        case IF_LT_I64: return "if_lt_i64";
+        case PROFILE_OP: return "profile_op";
+
+        default:
+        assert (false);
+        return "";
+    }
+}
 
-    if (opCache.find(instrPtr) != opCache.end())
+/// Map from instruction names to the opcodes that images may use
+std::unordered_map<std::string, Opcode> opNames;
+
+/// Resolve the opcode of an instruction object. This is only done
+/// when a block version is compiled, never during dispatch.
+Opcode decode(Object instr)
+{
+    // Fill the name table on first use
+    if (opNames.empty())
     {
-        //std::cout << "cache hit" << std::endl;
-        return opCache[instrPtr];
+        for (int op = 0; op < GET_LOCAL2; ++op)
+        {
+            // Stub branches are internal to the interpreter
+            if (op == JUMP_STUB || op == IF_TRUE_STUB)
+                continue;
+
+            opNames[opToStr((Opcode)op)] = (Opcode)op;
+        }
     }
 
     // Get the opcode string for this instruction
     static ICache opIC("op");
     auto opStr = (std::string)opIC.getStr(instr);
 
-    //std::cout << "decoding \"" << opStr << "\"" << std::endl;
-
-    Opcode op;
-
-    // Local variable access
-    if (opStr == "get_local")
-        op = GET_LOCAL;
-    else if (opStr == "set_local")
-        op = SET_LOCAL;
+    auto itr = opNames.find(opStr);
+    if (itr == opNames.end())
+        throw RunError("unknown op in decode \"" + opStr + "\"");
 
-    // Stack manipulation
-    else if (opStr == "push")
-        op = PUSH;
-    else if (opStr == "pop")
-        op = POP;
-    else if (opStr == "dup")
-        op = DUP;
-    else if (opStr == "push")
-        op = PUSH;
+    return itr->second;
+}
 
-    // 64-bit integer operations
-    else if (opStr == "add_i64")
-        op = ADD_I64;
-    else if (opStr == "sub_i64")
-        op = SUB_I64;
-    else if (opStr == "mul_i64")
-        op = MUL_I64;
-    else if (opStr == "lt_i64")
-        op = LT_I64;
-    else if (opStr == "le_i64")
-        op = LE_I64;
-    else if (opStr == "gt_i64")
-        op = GT_I64;
-    else if (opStr == "ge_i64")
-        op = GE_I64;
-    else if (opStr == "eq_i64")
-        op = EQ_I64;
+/// Get the type tag associated with a tag string (e.g. "int64")
+Tag strToTag(std::string tagStr)
+{
+    if (tagStr == "undef")
+        return TAG_UNDEF;
+    if (tagStr == "bool")
+        return TAG_BOOL;
+    if (tagStr == "int64")
+        return TAG_INT64;
+    if (tagStr == "float32")
+        return TAG_FLOAT32;
+    if (tagStr == "float64")
+        return TAG_FLOAT64;
+    if (tagStr == "string")
+        return TAG_STRING;
+    if (tagStr == "object")
+        return TAG_OBJECT;
+    if (tagStr == "array")
+        return TAG_ARRAY;
+    if (tagStr == "hostfn")
+        return TAG_HOSTFN;
+
+    throw RunError("unknown type tag \"" + tagStr + "\"");
+}
 
-    // String operations
-    else if (opStr == "str_len")
-        op = STR_LEN;
-    else if (opStr == "get_char")
-        op = GET_CHAR;
-    else if (opStr == "get_char_code")
-        op = GET_CHAR_CODE;
-    else if (opStr == "str_cat")
-        op = STR_CAT;
-    else if (opStr == "eq_str")
-        op = EQ_STR;
+/// Get the string name of a type tag
+std::string tagToStr(Tag tag)
+{
+    switch (tag)
+    {
+        case TAG_UNDEF: return "undef";
+        case TAG_BOOL: return "bool";
+        case TAG_INT64: return "int64";
+        case TAG_FLOAT32: return "float32";
+        case TAG_FLOAT64: return "float64";
+        case TAG_STRING: return "string";
+        case TAG_OBJECT: return "object";
+        case TAG_ARRAY: return "array";
+        case TAG_HOSTFN: return "hostfn";
+
+        default:
+        throw RunError("unknown value type in get_tag");
+    }
+}
 
-    // Object operations
-    else if (opStr == "new_object")
-        op = NEW_OBJECT;
-    else if (opStr == "has_field")
-        op = HAS_FIELD;
-    else if (opStr == "set_field")
-        op = SET_FIELD;
-    else if (opStr == "get_field")
-        op = GET_FIELD;
-    else if (opStr == "eq_obj")
-        op = EQ_OBJ;
+/// Test if an opcode is a branch instruction (block terminator)
+bool isBranch(Opcode op)
+{
+    switch (op)
+    {
+        case JUMP:
+        case JUMP_STUB:
+        case IF_TRUE:
+        case IF_TRUE_STUB:
+        case CALL:
+        case RET:
+        case CALL_IMM:
+        case IF_LOCAL_HAS_TAG:
+        case IF_LT_I64:
+        return true;
+
+        default:
+        return false;
+    }
+}
 
-    // Array operations
-    else if (opStr == "new_array")
-        op = NEW_ARRAY;
-    else if (opStr == "array_len")
-        op = ARRAY_LEN;
-    else if (opStr == "array_push")
-        op = ARRAY_PUSH;
-    else if (opStr == "get_elem")
-        op = GET_ELEM;
-    else if (opStr == "set_elem")
-        op = SET_ELEM;
+//============================================================================
+// Interpreter
+//============================================================================
 
-    // Miscellaneous
-    else if (opStr == "eq_bool")
-        op = EQ_BOOL;
-    else if (opStr == "has_tag")
-        op = HAS_TAG;
+/// Initial code heap size in bytes
+const size_t CODE_HEAP_INIT_SIZE = 1 << 26;
 
-    // Branch instructions
-    else if (opStr == "jump")
-        op = JUMP;
-    else if (opStr == "if_true")
-        op = IF_TRUE;
-    else if (opStr == "call")
-        op = CALL;
-    else if (opStr == "ret")
-        op = RET;
-
-    // VM interface
-    else if (opStr == "import")
-        op = IMPORT;
-    else if (opStr == "abort")
-        op = ABORT;
+/// Initial stack size in words
+const size_t STACK_INIT_SIZE = 1 << 20;
 
-    else
-        throw RunError("unknown op in decode \"" + opStr + "\"");
+/// Number of bookkeeping slots in each stack frame
+/// (return address, caller base pointer, caller frame pointer)
+const size_t FRAME_INFO_SLOTS = 3;
 
-    opCache[instrPtr] = op;
-    return op;
-}
+/// Local variable index operand type
+typedef uint32_t LocalIdx;
 
-Value call(Object fun, ValueVec args)
+class CodeFragment
 {
-    static ICache numParamsIC("num_params");
-    static ICache numLocalsIC("num_locals");
-    auto numParams = numParamsIC.getInt64(fun);
-    auto numLocals = numLocalsIC.getInt64(fun);
-    assert (args.size() <= numParams);
-    assert (numParams <= numLocals);
+public:
+
+    /// Start index in the executable heap
+    uint8_t* startPtr = nullptr;
 
-    ValueVec locals;
-    locals.resize(numLocals, Value::UNDEF);
+    /// End index in the executable heap
+    uint8_t* endPtr = nullptr;
 
-    // Copy the arguments into the locals
-    for (size_t i = 0; i < args.size(); ++i)
+    /// Get the length of the code fragment
+    size_t length()
     {
-        //std::cout << "  " << args[i].toString() << std::endl;
-        locals[i] = args[i];
+        assert (startPtr);
+        assert (endPtr);
+        return endPtr - startPtr;
     }
+};
 
-    // Temporary value stack
-    ValueVec stack;
+/// Tag of a value whose type is not known at compile time
+const Tag TAG_UNKNOWN = 0xFF;
 
-    // Array of instructions to execute
-    Value instrs;
+/**
+Code generation context. Holds the type tags known at some point in
+a block, which are used to specialize block versions.
+*/
+class CodeGenCtx
+{
+public:
 
-    // Number of instructions in the current block
-    size_t numInstrs = 0;
+    /// Known tags of local variables, indexed by local index
+    std::vector<Tag> localTags;
 
-    // Index of the next instruction to execute
-    size_t instrIdx = 0;
+    /// Known tags of the topmost temporary stack slots, with the
+    /// stack top last. Slots below these have unknown tags.
+    std::vector<Tag> stackTags;
 
-    auto popVal = [&stack]()
+    Tag getLocal(LocalIdx idx) const
     {
-        if (stack.empty())
-            throw RunError("op cannot pop value, stack empty");
-        auto val = stack.back();
-        stack.pop_back();
-        return val;
-    };
+        return (idx < localTags.size())? localTags[idx]:TAG_UNKNOWN;
+    }
 
-    auto popBool = [&popVal]()
+    void setLocal(LocalIdx idx, Tag tag)
     {
-        auto val = popVal();
-        if (!val.isBool())
-            throw RunError("op expects boolean value");
-        return (bool)val;
-    };
+        if (idx >= localTags.size())
+        {
+            if (tag == TAG_UNKNOWN)
+                return;
+            localTags.resize(idx + 1, TAG_UNKNOWN);
+        }
+
+        localTags[idx] = tag;
+    }
 
-    auto popInt64 = [&popVal]()
+    /// Get the tag of a stack slot, 0 being the stack top
+    Tag getStack(size_t idx) const
     {
-        auto val = popVal();
-        if (!val.isInt64())
-            throw RunError("op expects int64 value");
-        return (int64_t)val;
-    };
+        if (idx >= stackTags.size())
+            return TAG_UNKNOWN;
+        return stackTags[stackTags.size() - 1 - idx];
+    }
 
-    auto popStr = [&popVal]()
+    void push(Tag tag)
     {
-        auto val = popVal();
-        if (!val.isString())
-            throw RunError("op expects string value");
-        return String(val);
-    };
+        stackTags.push_back(tag);
+    }
 
-    auto popArray = [&popVal]()
+    Tag pop()
     {
-        auto val = popVal();
-        if (!val.isArray())
-            throw RunError("op expects array value");
-        return Array(val);
-    };
+        if (stackTags.empty())
+            return TAG_UNKNOWN;
+
+        auto tag = stackTags.back();
+        stackTags.pop_back();
+        return tag;
+    }
 
-    auto popObj = [&popVal]()
+    void pop(size_t numVals)
     {
-        auto val = popVal();
-        assert (val.isObject());
-        return Object(val);
-    };
+        for (size_t i = 0; i < numVals; ++i)
+            pop();
+    }
 
-    auto pushBool = [&stack](bool val)
+    /// Drop trailing unknown local tags and unknown tags at the
+    /// bottom of the known stack slots, so that equivalent contexts
+    /// compare equal
+    void normalize()
     {
-        stack.push_back(val? Value::TRUE:Value::FALSE);
-    };
+        while (!localTags.empty() && localTags.back() == TAG_UNKNOWN)
+            localTags.pop_back();
+
+        size_t numUnknown = 0;
+        while (numUnknown < stackTags.size() && stackTags[numUnknown] == TAG_UNKNOWN)
+            numUnknown++;
+        stackTags.erase(stackTags.begin(), stackTags.begin() + numUnknown);
+    }
 
-    auto branchTo = [&instrs, &numInstrs, &instrIdx](Object targetBB)
+    bool isGeneric() const
     {
-        //std::cout << "branching" << std::endl;
+        return localTags.empty() && stackTags.empty();
+    }
 
-        if (instrIdx != numInstrs)
+    /// Test if code specialized for this context can be entered from
+    /// a point where the tags in the other context are known
+    bool acceptsCtx(const CodeGenCtx& that) const
+    {
+        for (size_t i = 0; i < localTags.size(); ++i)
         {
-            throw RunError(
-                "only the last instruction in a block can be a branch ("
-                "instrIdx=" + std::to_string(instrIdx) + ", " +
-                "numInstrs=" + std::to_string(numInstrs) + ")"
-            );
+            if (localTags[i] != TAG_UNKNOWN &&
+                localTags[i] != that.getLocal(i))
+                return false;
         }
 
-        static ICache instrsIC("instrs");
-        Array instrArr = instrsIC.getArr(targetBB);
-
-        instrs = (Value)instrArr;
-        numInstrs = instrArr.length();
-        instrIdx = 0;
-
-        if (numInstrs == 0)
+        for (size_t i = 0; i < stackTags.size(); ++i)
         {
-            throw RunError("target basic block is empty");
+            if (getStack(i) != TAG_UNKNOWN &&
+                getStack(i) != that.getStack(i))
+                return false;
         }
-    };
-
-    // Get the entry block for this function
-    static ICache entryIC("entry");
-    Object entryBB = entryIC.getObj(fun);
 
-    // Branch to the entry block
-    branchTo(entryBB);
+        return true;
+    }
 
-    // For each instruction to execute
-    for (;;)
+    bool operator == (const CodeGenCtx& that) const
     {
-        assert (instrIdx < numInstrs);
+        return localTags == that.localTags && stackTags == that.stackTags;
+    }
+};
 
-        //std::cout << "cycleCount=" << cycleCount << std::endl;
-        //std::cout << "instrIdx=" << instrIdx << std::endl;
+class BlockVersion : public CodeFragment
+{
+public:
 
-        Array instrArr = Array(instrs);
-        Value instrVal = instrArr.getElem(instrIdx);
-        assert (instrVal.isObject());
-        auto instr = Object(instrVal);
+    /// Associated block
+    Object block;
 
-        cycleCount++;
-        instrIdx++;
+    /// Code generation context at block entry
+    CodeGenCtx ctx;
 
-        // Get the opcode for this instruction
-        auto op = decode(instr);
+    /// Source position table of the function the block belongs to
+    refptr posTable = nullptr;
 
-        switch (op)
-        {
-            // Read a local variable and push it on the stack
-            case GET_LOCAL:
-            {
-                static ICache icache("idx");
-                auto localIdx = icache.getInt64(instr);
-                //std::cout << "localIdx=" << localIdx << std::endl;
-                assert (localIdx < locals.size());
-                stack.push_back(locals[localIdx]);
-            }
-            break;
+    /// Machine code compiled from this version, if any
+    CodeFragment jitCode;
 
-            // Set a local variable
-            case SET_LOCAL:
-            {
-                static ICache icache("idx");
-                auto localIdx = icache.getInt64(instr);
-                //std::cout << "localIdx=" << localIdx << std::endl;
-                assert (localIdx < locals.size());
-                locals[localIdx] = popVal();
-            }
-            break;
+    BlockVersion(Object block, const CodeGenCtx& ctx)
+    : block(block),
+      ctx(ctx)
+    {
+    }
+};
 
-            case PUSH:
-            {
-                static ICache icache("val");
-                auto val = icache.getField(instr);
-                stack.push_back(val);
-            }
-            break;
+typedef std::vector<BlockVersion*> VersionList;
 
-            case POP:
-            {
-                if (stack.empty())
-                    throw RunError("pop failed, stack empty");
-                stack.pop_back();
-            }
-            break;
+/// Flat array of bytes into which code gets compiled
+uint8_t* codeHeap = nullptr;
 
-            // Duplicate the top of the stack
-            case DUP:
-            {
-                static ICache idxIC("idx");
-                auto idx = idxIC.getInt64(instr);
+/// Limit pointer for the code heap
+uint8_t* codeHeapLimit = nullptr;
 
-                if (idx >= stack.size())
-                    throw RunError("stack undeflow, invalid index for dup");
+/// Current allocation pointer in the code heap
+uint8_t* codeHeapAlloc = nullptr;
 
-                auto val = stack[stack.size() - 1 - idx];
-                stack.push_back(val);
-            }
-            break;
+/// Map of block objects to lists of versions
+std::unordered_map<refptr, VersionList> versionMap;
 
-            // Swap the topmost two stack elements
-            case SWAP:
-            {
-                auto v0 = popVal();
-                auto v1 = popVal();
-                stack.push_back(v0);
-                stack.push_back(v1);
-            }
-            break;
+/// Block versions created or compiled since the last collection. Only
+/// these can refer to nursery objects from their block, position table
+/// or code, so minor collections scan nothing else of the code heap.
+std::vector<BlockVersion*> youngVersions;
 
-            //
-            // 64-bit integer operations
-            //
+/// Call site caches which received a nursery callee
+/// since the last collection
+std::vector<refptr*> youngCallees;
 
-            case ADD_I64:
-            {
-                auto arg1 = popInt64();
-                auto arg0 = popInt64();
-                stack.push_back(arg0 + arg1);
-            }
-            break;
+/// Run code through the JIT compiler, when available
+bool useJit = true;
 
-            case SUB_I64:
-            {
-                auto arg1 = popInt64();
-                auto arg0 = popInt64();
-                stack.push_back(arg0 - arg1);
-            }
-            break;
+/// Size of the stack in words
+size_t stackSize = 0;
 
-            case MUL_I64:
-            {
-                auto arg1 = popInt64();
-                auto arg0 = popInt64();
-                stack.push_back(arg0 * arg1);
-            }
-            break;
+/// Lower stack limit (stack pointer must be greater than this)
+Value* stackLimit = nullptr;
 
-            case LT_I64:
-            {
-                auto arg1 = popInt64();
-                auto arg0 = popInt64();
-                pushBool(arg0 < arg1);
-            }
-            break;
+/// Stack bottom (end of the stack memory array)
+Value* stackBottom = nullptr;
 
-            case LE_I64:
-            {
-                auto arg1 = popInt64();
-                auto arg0 = popInt64();
-                pushBool(arg0 <= arg1);
-            }
-            break;
+/// Stack frame base pointer
+Value* basePtr = nullptr;
 
-            case GT_I64:
-            {
-                auto arg1 = popInt64();
-                auto arg0 = popInt64();
-                pushBool(arg0 > arg1);
-            }
-            break;
+/// Pointer to the bookkeeping slots of the current stack frame
+Value* framePtr = nullptr;
 
-            case GE_I64:
-            {
-                auto arg1 = popInt64();
-                auto arg0 = popInt64();
-                pushBool(arg0 >= arg1);
-            }
-            break;
+/// Current temp stack top pointer
+Value* stackPtr = nullptr;
 
-            case EQ_I64:
-            {
-                auto arg1 = popInt64();
-                auto arg0 = popInt64();
-                pushBool(arg0 == arg1);
-            }
-            break;
+// Current instruction pointer
+uint8_t* instrPtr = nullptr;
 
-            //
-            // String operations
-            //
+#ifdef THREADED_DISPATCH
+/// Opcode field of instructions in the code heap
+typedef void* OpField;
 
-            case STR_LEN:
-            {
-                auto str = popStr();
-                stack.push_back(str.length());
-            }
-            break;
+/// Instruction handler addresses, indexed by opcode
+void* opHandlers[NUM_OPCODES];
+#else
+/// Opcode field of instructions in the code heap
+typedef Opcode OpField;
+#endif
 
-            case GET_CHAR:
-            {
-                auto idx = (size_t)popInt64();
-                auto str = popStr();
+// Write a value to the code heap
+template <typename T> void writeVal(T val)
+{
+    if (codeHeapAlloc + sizeof(T) > codeHeapLimit)
+        throw RunError("code heap exhausted");
 
-                if (idx >= str.length())
-                {
-                    throw RunError(
-                        "get_char, index out of bounds"
-                    );
-                }
+    T* heapPtr = (T*)codeHeapAlloc;
+    *heapPtr = val;
+    codeHeapAlloc += sizeof(T);
+}
 
-                auto ch = str[idx];
+/// Get the opcode field value for an opcode
+inline OpField encodeOp(Opcode op)
+{
+#ifdef THREADED_DISPATCH
+    return opHandlers[op];
+#else
+    return op;
+#endif
+}
 
-                // Cache single-character strings
-                if (charStrings[ch] == Value::FALSE)
-                {
-                    char buf[2] = { (char)str[idx], '\0' };
-                    charStrings[ch] = String(buf);
-                }
+// Write an opcode to the code heap
+void writeOp(Opcode op)
+{
+    writeVal(encodeOp(op));
+}
+
+template <typename T> T readVal()
+{
+    assert (instrPtr + sizeof(T) <= codeHeapLimit);
+    T* valPtr = (T*)instrPtr;
+    auto val = *valPtr;
+    instrPtr += sizeof(T);
+    return val;
+}
+
+// Get a reference to mutable state stored inline in an instruction
+template <typename T> T& readRef()
+{
+    assert (instrPtr + sizeof(T) <= codeHeapLimit);
+    T* valPtr = (T*)instrPtr;
+    instrPtr += sizeof(T);
+    return *valPtr;
+}
+
+/**
+Function information needed to perform a call. Call instructions
+hold one of these as a per-site cache of the last callee.
+*/
+struct FunInfo
+{
+    /// Function object this information was read from
+    refptr fun = nullptr;
+
+    /// Number of parameters and local variables
+    uint32_t numParams = 0;
+    uint32_t numLocals = 0;
+
+    /// Entry block version
+    BlockVersion* entryVer = nullptr;
+};
+
+/// Call site cache hit/miss counts
+size_t callCacheHits = 0;
+size_t callCacheMisses = 0;
+
+Value execCode(bool initHandlers = false);
+
+#ifdef HAVE_JIT
+void initJit();
+#endif
+
+void forwardInterpRefs();
+
+/// Initialize the interpreter
+void initInterp()
+{
+#ifdef THREADED_DISPATCH
+    // Get the instruction handler addresses
+    execCode(true);
+#endif
+
+    // Allocate the code heap
+    codeHeap = new uint8_t[CODE_HEAP_INIT_SIZE];
+    codeHeapLimit = codeHeap + CODE_HEAP_INIT_SIZE;
+    codeHeapAlloc = codeHeap;
+
+#ifdef HAVE_JIT
+    if (useJit)
+        initJit();
+#else
+    useJit = false;
+#endif
+
+    // Allocate the stack
+    stackSize = STACK_INIT_SIZE;
+    stackLimit = new Value[STACK_INIT_SIZE];
+    stackBottom = stackLimit + STACK_INIT_SIZE;
+    stackPtr = stackBottom;
+
+    // Register the references held by the interpreter with the GC
+    for (auto& str : charStrings)
+        vm.addRoot(&str);
+    vm.addRootFn(forwardInterpRefs);
+}
+
+/// Maximum number of versions generated for each block
+size_t maxVersions = 4;
+
+/// Number of type tests resolved at compile time
+size_t staticTagTests = 0;
+
+/// Number of type tests left to be done at run time
+size_t dynamicTagTests = 0;
+
+/**
+Get a version of a block specialized for the given context. This version
+will be a stub until compiled. Once a block has reached the version limit,
+an existing version compatible with the context is reused, falling back
+to a generic version which makes no assumptions about types.
+*/
+BlockVersion* getBlockVersion(
+    Object block,
+    CodeGenCtx ctx = CodeGenCtx(),
+    refptr posTable = nullptr
+)
+{
+    ctx.normalize();
+
+    auto& versions = versionMap[(refptr)block];
+
+    // Look for an existing version for this context
+    for (auto version : versions)
+    {
+        if (version->ctx == ctx)
+            return version;
+    }
+
+    // If the version limit is reached, or would be reached
+    // without leaving room for a generic version
+    if (versions.size() + 1 >= maxVersions && !ctx.isGeneric())
+    {
+        for (auto version : versions)
+        {
+            if (version->ctx.acceptsCtx(ctx))
+                return version;
+        }
+
+        ctx = CodeGenCtx();
+    }
+
+    auto newVersion = new BlockVersion(block, ctx);
+    newVersion->posTable = posTable;
+    versions.push_back(newVersion);
+    youngVersions.push_back(newVersion);
+
+    return newVersion;
+}
+
+/// Get a block version for a branch target field of an instruction
+/// Branch targets are in the same function as the branch
+BlockVersion* getTargetVersion(
+    Object instr,
+    ICache& targetIC,
+    const CodeGenCtx& ctx,
+    const BlockVersion* version
+)
+{
+    return getBlockVersion(targetIC.getObj(instr), ctx, version->posTable);
+}
+
+/// Get the optional source position associated with an instruction
+SrcPos getSrcPos(Object instr, const BlockVersion* version)
+{
+    SrcPos srcPos;
+
+    if (version->posTable && instr.hasField("src_pos"))
+    {
+        auto idx = instr.getField("src_pos");
+
+        if (!idx.isInt64() || (int64_t)idx < 0)
+            throw RunError("invalid source position index");
+
+        srcPos.table = version->posTable;
+        srcPos.idx = (int64_t)idx;
+    }
+
+    return srcPos;
+}
+
+/// Get the opcode for an opcode field in the code heap
+Opcode decodeOp(OpField opField)
+{
+#ifdef THREADED_DISPATCH
+    for (size_t i = 0; i < NUM_OPCODES; ++i)
+    {
+        if (opHandlers[i] == opField)
+            return (Opcode)i;
+    }
+
+    assert (false);
+    return ABORT;
+#else
+    return opField;
+#endif
+}
+
+/// Read a value from the code heap at a given location
+template <typename T> T readCode(uint8_t*& codePtr)
+{
+    auto val = *(T*)codePtr;
+    codePtr += sizeof(T);
+    return val;
+}
+
+/// Get the size in bytes of the operands of an instruction
+size_t operandSize(Opcode op)
+{
+    // Operands of a call instruction
+    const size_t callSize = (
+        sizeof(LocalIdx) +
+        sizeof(BlockVersion*) +
+        sizeof(SrcPos) +
+        sizeof(const CodeGenCtx*) +
+        sizeof(FunInfo)
+    );
+
+    switch (op)
+    {
+        case GET_LOCAL:
+        case SET_LOCAL:
+        case DUP:
+        return sizeof(LocalIdx);
+
+        case PUSH:
+        return sizeof(Value);
+
+        case ABORT:
+        return sizeof(SrcPos);
+
+        case HAS_FIELD:
+        case SET_FIELD:
+        case GET_FIELD:
+        return sizeof(FieldCache);
+
+        case GET_PROP:
+        return sizeof(PropCache);
+
+        case NEW_OBJECT_LIT:
+        return sizeof(ObjLitCache*);
+
+        case HAS_TAG:
+        return sizeof(Tag);
+
+        case JUMP:
+        case JUMP_STUB:
+        return sizeof(void*);
+
+        case IF_TRUE:
+        case IF_TRUE_STUB:
+        case IF_LT_I64:
+        return 2 * sizeof(void*);
+
+        case CALL:
+        return callSize;
+
+        case GET_LOCAL2:
+        return 2 * sizeof(LocalIdx);
+
+        case GET_LOCAL_PUSH:
+        return sizeof(LocalIdx) + sizeof(Value);
+
+        case GET_FIELD_IMM:
+        return 2 * sizeof(Value) + sizeof(FieldCache);
+
+        case CALL_IMM:
+        return sizeof(Value) + callSize;
+
+        case IF_LOCAL_HAS_TAG:
+        return sizeof(LocalIdx) + sizeof(Tag) + 2 * sizeof(void*);
+
+        case PROFILE_OP:
+        return sizeof(void*);
+
+        default:
+        return 0;
+    }
+}
+
+/// Fuse instruction sequences into superinstructions
+bool useFusion = true;
+
+/**
+Replace common instruction sequences in a newly compiled block version
+by superinstructions. The sequences fused are the instruction pairs and
+triples executed most often on the fib29 and incr_field_1m benchmarks,
+as measured within blocks by dynamic count:
+
+  get_local; push                 7.4M
+  get_local; get_local            6.6M
+  push; call                      5.5M
+  get_local; has_tag; if_true     5.4M
+  lt_i64; if_true                 2.7M
+  push; push; get_field           1.7M
+*/
+void fuseInstrs(BlockVersion* version)
+{
+    // Copy the code of the block, which gets rewritten in place
+    std::vector<uint8_t> code(version->startPtr, version->endPtr);
+    codeHeapAlloc = version->startPtr;
+
+    // Decode the instructions
+    std::vector<Opcode> ops;
+    std::vector<uint8_t*> operands;
+    for (auto codePtr = code.data(); codePtr < code.data() + code.size();)
+    {
+        auto op = decodeOp(readCode<OpField>(codePtr));
+        ops.push_back(op);
+        operands.push_back(codePtr);
+        codePtr += operandSize(op);
+    }
+
+    auto numInstrs = ops.size();
+
+    // Test if the instructions starting at index i match a sequence
+    auto match = [&](size_t i, std::initializer_list<Opcode> seq)
+    {
+        if (i + seq.size() > numInstrs)
+            return false;
+        for (auto op : seq)
+        {
+            if (ops[i++] != op)
+                return false;
+        }
+        return true;
+    };
+
+    for (size_t i = 0; i < numInstrs;)
+    {
+        if (match(i, { GET_LOCAL, HAS_TAG, IF_TRUE_STUB }))
+        {
+            writeOp(IF_LOCAL_HAS_TAG);
+            writeVal(*(LocalIdx*)operands[i]);
+            writeVal(*(Tag*)operands[i+1]);
+            writeVal(((BlockVersion**)operands[i+2])[0]);
+            writeVal(((BlockVersion**)operands[i+2])[1]);
+            i += 3;
+            continue;
+        }
+
+        // Reads of object fields with constant names, such as globals
+        if (match(i, { PUSH, PUSH, GET_FIELD }) &&
+            ((Value*)operands[i])->isObject() &&
+            ((Value*)operands[i+1])->isString())
+        {
+            writeOp(GET_FIELD_IMM);
+            writeVal(*(Value*)operands[i]);
+            writeVal(*(Value*)operands[i+1]);
+            writeVal(*(FieldCache*)operands[i+2]);
+            i += 3;
+            continue;
+        }
+
+        if (match(i, { LT_I64, IF_TRUE_STUB }))
+        {
+            writeOp(IF_LT_I64);
+            writeVal(((BlockVersion**)operands[i+1])[0]);
+            writeVal(((BlockVersion**)operands[i+1])[1]);
+            i += 2;
+            continue;
+        }
+
+        if (match(i, { PUSH, CALL }))
+        {
+            writeOp(CALL_IMM);
+            writeVal(*(Value*)operands[i]);
+            for (size_t j = 0; j < operandSize(CALL); ++j)
+                writeVal(operands[i+1][j]);
+            i += 2;
+            continue;
+        }
+
+        if (match(i, { GET_LOCAL, GET_LOCAL }))
+        {
+            writeOp(GET_LOCAL2);
+            writeVal(*(LocalIdx*)operands[i]);
+            writeVal(*(LocalIdx*)operands[i+1]);
+            i += 2;
+            continue;
+        }
+
+        if (match(i, { GET_LOCAL, PUSH }))
+        {
+            writeOp(GET_LOCAL_PUSH);
+            writeVal(*(LocalIdx*)operands[i]);
+            writeVal(*(Value*)operands[i+1]);
+            i += 2;
+            continue;
+        }
+
+        // Copy other instructions as they are
+        writeOp(ops[i]);
+        for (size_t j = 0; j < operandSize(ops[i]); ++j)
+            writeVal(operands[i][j]);
+        i++;
+    }
+
+    version->endPtr = codeHeapAlloc;
+}
+
+/// Get the source position of a compiled instruction. Only
+/// calls and aborts carry their source position.
+SrcPos getInstrSrcPos(Opcode op, const uint8_t* operands)
+{
+    if (op == CALL)
+        return *(SrcPos*)(operands + sizeof(LocalIdx) + sizeof(BlockVersion*));
+    if (op == CALL_IMM)
+        return *(SrcPos*)(operands + sizeof(Value) + sizeof(LocalIdx) + sizeof(BlockVersion*));
+    if (op == ABORT)
+        return *(SrcPos*)operands;
+
+    return SrcPos();
+}
+
+/// Count instruction executions
+bool opProfiling = false;
+
+/// Instruction being profiled
+struct ProfileSite
+{
+    Opcode op;
+
+    /// Source position of the instruction, if known
+    SrcPos srcPos;
+
+    /// Execution count
+    size_t count = 0;
+};
+
+/// Profiled instructions, in compilation order
+std::vector<ProfileSite*> profileSites;
+
+/// Execution counts per opcode, opcode pair and opcode trigram
+std::vector<size_t> opCounts;
+std::vector<size_t> pairCounts;
+std::vector<size_t> trigramCounts;
+
+/// Last two opcodes executed in the current block, NUM_OPCODES if none
+Opcode prevOp1 = NUM_OPCODES;
+Opcode prevOp2 = NUM_OPCODES;
+
+/**
+Insert profiling instructions before each instruction of a newly
+compiled block version. This is only done when profiling is enabled,
+so that execution is otherwise unaffected.
+*/
+void addProfiling(BlockVersion* version)
+{
+    if (opCounts.empty())
+    {
+        opCounts.resize(NUM_OPCODES, 0);
+        pairCounts.resize(NUM_OPCODES * NUM_OPCODES, 0);
+        trigramCounts.resize(NUM_OPCODES * NUM_OPCODES * NUM_OPCODES, 0);
+    }
+
+    // Copy the code of the block, which gets rewritten in place
+    std::vector<uint8_t> code(version->startPtr, version->endPtr);
+    codeHeapAlloc = version->startPtr;
+
+    for (auto codePtr = code.data(); codePtr < code.data() + code.size();)
+    {
+        auto instrPtr = codePtr;
+        auto op = decodeOp(readCode<OpField>(codePtr));
+        auto operands = codePtr;
+        codePtr += operandSize(op);
+
+        auto site = new ProfileSite();
+        site->op = op;
+        site->srcPos = getInstrSrcPos(op, operands);
+
+        profileSites.push_back(site);
+
+        writeOp(PROFILE_OP);
+        writeVal(site);
+
+        for (auto bytePtr = instrPtr; bytePtr < codePtr; ++bytePtr)
+            writeVal(*bytePtr);
+    }
+
+    version->endPtr = codeHeapAlloc;
+}
+
+/// Count the execution of a profiled instruction
+inline void profileOp(ProfileSite* site)
+{
+    auto op = site->op;
+    site->count++;
+
+    opCounts[op]++;
+
+    if (prevOp1 != NUM_OPCODES)
+    {
+        pairCounts[prevOp1 * NUM_OPCODES + op]++;
+
+        if (prevOp2 != NUM_OPCODES)
+            trigramCounts[(prevOp2 * NUM_OPCODES + prevOp1) * NUM_OPCODES + op]++;
+    }
+
+    // Sequences are counted within blocks only
+    if (isBranch(op))
+    {
+        prevOp1 = NUM_OPCODES;
+        prevOp2 = NUM_OPCODES;
+    }
+    else
+    {
+        prevOp2 = prevOp1;
+        prevOp1 = op;
+    }
+}
+
+/// Sample allocations, attributing them to the executing instruction
+bool allocProfiling = false;
+
+/// Names of the blocks defined in images, recorded while profiling
+std::unordered_map<refptr, std::string> blockNames;
+
+/// Compiled block versions by start address, to find the
+/// instruction executing when an allocation is sampled
+std::map<uint8_t*, BlockVersion*> versionsByAddr;
+
+/// Labels of the call sites returning to each block version,
+/// which make up the call stacks of allocation samples
+std::unordered_map<BlockVersion*, std::string> callSiteLabels;
+
+/// Record the name of a block defined in an image
+void nameBlock(const std::string& srcName, const std::string& name, Value val)
+{
+    if (val.isObject() && Object(val).hasField("instrs"))
+        blockNames[(refptr)val] = srcName + ":" + name;
+}
+
+/// Number of anonymous blocks labelled so far
+size_t numAnonBlocks = 0;
+
+/// Get a label for the block a version was compiled from. Blocks
+/// generated by language packages have no names, they are numbered
+/// and identified by their source file when known.
+std::string blockLabel(BlockVersion* version)
+{
+    auto& name = blockNames[(refptr)version->block];
+
+    if (name == "")
+    {
+        name = "anonymous block " + std::to_string(++numAnonBlocks);
+
+        if (version->posTable)
+        {
+            auto table = Array(Value(version->posTable, TAG_ARRAY));
+            if (table.length() > 0 && table.getElem(0).isString())
+                name = (std::string)table.getElem(0) + ":" + name;
+        }
+    }
+
+    return name;
+}
+
+/// Compile a block version into the code heap
+void compile(BlockVersion* version)
+{
+    auto block = version->block;
+
+    // Get the instructions array
+    static ICache instrsIC("instrs");
+    Array instrs = instrsIC.getArr(block);
+    auto numInstrs = instrs.length();
+
+    if (numInstrs == 0)
+    {
+        throw RunError("target basic block is empty");
+    }
+
+    // Type tags known at the current instruction
+    CodeGenCtx ctx = version->ctx;
+
+    // Last instruction written, which may be rewritten when
+    // the instruction following it is specialized
+    Opcode lastOp = ABORT;
+    uint8_t* lastInstrPtr = nullptr;
+
+    // Local variable and tag tested by the last instruction,
+    // when it was a has_tag on a local
+    LocalIdx testLocal = 0;
+    Tag testTag = TAG_UNKNOWN;
+
+    // Mark the block start
+    version->startPtr = codeHeapAlloc;
+
+    // For each instruction
+    for (size_t i = 0; i < numInstrs; ++i)
+    {
+        auto instrVal = instrs.getElem(i);
+        assert (instrVal.isObject());
+        auto instr = (Object)instrVal;
+
+        // Get the opcode for this instruction
+        auto op = decode(instr);
+
+        if (isBranch(op) && i + 1 != numInstrs)
+        {
+            throw RunError(
+                "only the last instruction in a block can be a branch ("
+                "instrIdx=" + std::to_string(i) + ", " +
+                "numInstrs=" + std::to_string(numInstrs) + ")"
+            );
+        }
+
+        if (!isBranch(op) && op != ABORT && i + 1 == numInstrs)
+        {
+            throw RunError(
+                "the last instruction in a block must be a branch"
+            );
+        }
+
+        auto prevOp = lastOp;
+        auto prevInstrPtr = lastInstrPtr;
+        auto prevTestTag = testTag;
+        lastOp = op;
+        lastInstrPtr = codeHeapAlloc;
+        testTag = TAG_UNKNOWN;
+
+        switch (op)
+        {
+            case GET_LOCAL:
+            case SET_LOCAL:
+            case DUP:
+            {
+                static ICache idxIC("idx");
+                auto idx = idxIC.getInt64(instr);
+
+                if (idx < 0)
+                    throw RunError("negative index operand");
+
+                writeOp(op);
+                writeVal((LocalIdx)idx);
+
+                if (op == GET_LOCAL)
+                    ctx.push(ctx.getLocal(idx));
+                else if (op == SET_LOCAL)
+                    ctx.setLocal(idx, ctx.pop());
+                else
+                    ctx.push(ctx.getStack(idx));
+            }
+            break;
+
+            case PUSH:
+            {
+                static ICache valIC("val");
+                auto val = valIC.getField(instr);
+
+                // Intern identifier-like string constants, so that
+                // they can be used as keys in field caches
+                if (val.isString() && isValidIdent(val))
+                    val = String::internPinned(String(val));
+
+                writeOp(op);
+                writeVal(val);
+                ctx.push(val.getTag());
+            }
+            break;
+
+            case POP:
+            writeOp(op);
+            ctx.pop();
+            break;
+
+            case SWAP:
+            {
+                writeOp(op);
+                auto t0 = ctx.pop();
+                auto t1 = ctx.pop();
+                ctx.push(t0);
+                ctx.push(t1);
+            }
+            break;
+
+            // Field accesses carry a per-site field cache
+            case HAS_FIELD:
+            case GET_FIELD:
+            case SET_FIELD:
+            {
+                writeOp(op);
+                writeVal(FieldCache());
+
+                if (op == SET_FIELD)
+                {
+                    ctx.pop(3);
+                }
+                else
+                {
+                    ctx.pop(2);
+                    ctx.push((op == HAS_FIELD)? TAG_BOOL:TAG_UNKNOWN);
+                }
+            }
+            break;
+
+            // Property reads carry a per-site property cache
+            case GET_PROP:
+            writeOp(op);
+            writeVal(PropCache());
+            ctx.pop(2);
+            ctx.push(TAG_UNKNOWN);
+            ctx.push(TAG_BOOL);
+            break;
+
+            // Object literals carry their field names and a shape cache
+            case NEW_OBJECT_LIT:
+            {
+                static ICache fieldsIC("fields");
+                auto fields = fieldsIC.getArr(instr);
+
+                auto cache = new ObjLitCache();
+                for (size_t i = 0; i < fields.length(); ++i)
+                {
+                    auto name = fields.getElem(i);
+
+                    if (!name.isString() || !isValidIdent(name))
+                    {
+                        throw RunError(
+                            "invalid field name in new_object_lit"
+                        );
+                    }
+
+                    name = String::internPinned(String(name));
+
+                    for (auto prevName : cache->names)
+                        if (prevName == name)
+                            cache->repeatedNames = true;
+
+                    cache->names.push_back(name);
+                }
+
+                writeOp(op);
+                writeVal(cache);
+                ctx.pop(fields.length());
+                ctx.push(TAG_OBJECT);
+            }
+            break;
+
+            // Type tests on values of known type are resolved here
+            case HAS_TAG:
+            {
+                static ICache tagIC("tag");
+                auto tagStr = (std::string)tagIC.getStr(instr);
+                auto tag = strToTag(tagStr);
+                auto valTag = ctx.pop();
+                ctx.push(TAG_BOOL);
+
+                if (valTag == TAG_UNKNOWN)
+                {
+                    dynamicTagTests++;
+                    writeOp(op);
+                    writeVal(tag);
+
+                    // Remember which local is being tested, so that
+                    // a following branch can specialize on the result
+                    if (prevOp == GET_LOCAL)
+                    {
+                        testLocal = *(LocalIdx*)(prevInstrPtr + sizeof(OpField));
+                        testTag = tag;
+                    }
+
+                    break;
+                }
+
+                staticTagTests++;
+
+                // If the value was just read from a local, the read
+                // is removed, otherwise the value is popped
+                if (prevOp == GET_LOCAL)
+                    codeHeapAlloc = prevInstrPtr;
+                else
+                    writeOp(POP);
+
+                lastOp = PUSH;
+                lastInstrPtr = codeHeapAlloc;
+                writeOp(PUSH);
+                writeVal((valTag == tag)? Value::TRUE:Value::FALSE);
+            }
+            break;
+
+            // Branch targets are compiled lazily, the first time
+            // the branch is executed
+            case JUMP:
+            {
+                static ICache toIC("to");
+                writeOp(JUMP_STUB);
+                writeVal(getTargetVersion(instr, toIC, ctx, version));
+            }
+            break;
+
+            case IF_TRUE:
+            {
+                static ICache thenIC("then");
+                static ICache elseIC("else");
+                ctx.pop();
+
+                // If the branch condition is a known boolean constant,
+                // the branch becomes a jump to one of the targets. Other
+                // constants are left for if_true to raise a type error.
+                if (prevOp == PUSH &&
+                    (*(Value*)(prevInstrPtr + sizeof(OpField))).isBool())
+                {
+                    auto cond = *(Value*)(prevInstrPtr + sizeof(OpField));
+                    codeHeapAlloc = prevInstrPtr;
+                    writeOp(JUMP_STUB);
+                    writeVal(getTargetVersion(
+                        instr,
+                        (cond == Value::TRUE)? thenIC:elseIC,
+                        ctx,
+                        version
+                    ));
+                    break;
+                }
+
+                // If the condition is a type test on a local, the
+                // then branch knows the type of that local
+                auto thenCtx = ctx;
+                if (prevOp == HAS_TAG && prevTestTag != TAG_UNKNOWN)
+                    thenCtx.setLocal(testLocal, prevTestTag);
+
+                writeOp(IF_TRUE_STUB);
+                writeVal(getTargetVersion(instr, thenIC, thenCtx, version));
+                writeVal(getTargetVersion(instr, elseIC, ctx, version));
+            }
+            break;
+
+            case CALL:
+            {
+                static ICache retToIC("ret_to");
+                static ICache numArgsIC("num_args");
+                auto numArgs = numArgsIC.getInt64(instr);
+
+                if (numArgs < 0)
+                    throw RunError("negative argument count in call");
+
+                // Tags of the arguments, which become the
+                // first locals of the callee
+                CodeGenCtx argCtx;
+                for (LocalIdx i = 0; i < numArgs; ++i)
+                    argCtx.setLocal(i, ctx.getStack(numArgs - i));
+                argCtx.normalize();
+
+                // The callee and arguments are replaced by
+                // the return value
+                ctx.pop(numArgs + 1);
+                ctx.push(TAG_UNKNOWN);
+
+                auto retVer = getTargetVersion(instr, retToIC, ctx, version);
+                auto srcPos = getSrcPos(instr, version);
+
+                writeOp(op);
+                writeVal((LocalIdx)numArgs);
+                writeVal(retVer);
+                writeVal(srcPos);
+                writeVal((const CodeGenCtx*)(
+                    argCtx.isGeneric()? nullptr:new CodeGenCtx(argCtx)
+                ));
+                writeVal(FunInfo());
+
+                // Frames returning to this version are labelled with
+                // the call site in the allocation profile
+                if (allocProfiling)
+                {
+                    callSiteLabels[retVer] = srcPos.isValid()?
+                        posToString(srcPos):
+                        "call in " + blockLabel(version);
+                }
+            }
+            break;
+
+            case ABORT:
+            {
+                writeOp(op);
+                writeVal(getSrcPos(instr, version));
+            }
+            break;
+
+            case RET:
+            writeOp(op);
+            break;
+
+            // Instructions without operands
+            default:
+            {
+                writeOp(op);
+
+                // Number of values consumed and type of
+                // the value produced by each operation
+                size_t numPops;
+                Tag outTag = TAG_UNKNOWN;
+                bool hasOut = true;
+                switch (op)
+                {
+                    case ADD_I64: case SUB_I64: case MUL_I64:
+                    numPops = 2; outTag = TAG_INT64; break;
+
+                    case LT_I64: case LE_I64: case GT_I64: case GE_I64:
+                    case EQ_I64: case EQ_STR: case EQ_OBJ: case EQ_BOOL:
+                    numPops = 2; outTag = TAG_BOOL; break;
+
+                    case STR_LEN: case ARRAY_LEN:
+                    numPops = 1; outTag = TAG_INT64; break;
+
+                    case GET_CHAR: case STR_CAT:
+                    numPops = 2; outTag = TAG_STRING; break;
+
+                    case GET_CHAR_CODE:
+                    numPops = 2; outTag = TAG_INT64; break;
+
+                    case NEW_OBJECT: case IMPORT:
+                    numPops = 1; outTag = TAG_OBJECT; break;
+
+                    case NEW_ARRAY:
+                    numPops = 1; outTag = TAG_ARRAY; break;
+
+                    case GET_TAG:
+                    numPops = 1; outTag = TAG_STRING; break;
+
+                    case GET_ELEM:
+                    numPops = 2; outTag = TAG_UNKNOWN; break;
+
+                    case ARRAY_PUSH:
+                    numPops = 2; hasOut = false; break;
+
+                    case SET_ELEM:
+                    numPops = 3; hasOut = false; break;
+
+                    default:
+                    assert (false);
+                    numPops = 0; hasOut = false;
+                }
+
+                ctx.pop(numPops);
+                if (hasOut)
+                    ctx.push(outTag);
+            }
+            break;
+        }
+    }
+
+    // Mark the block end
+    version->endPtr = codeHeapAlloc;
+
+    if (useFusion)
+        fuseInstrs(version);
+
+    if (opProfiling)
+        addProfiling(version);
+
+    // The code may hold constants from the nursery
+    youngVersions.push_back(version);
+
+    if (allocProfiling)
+        versionsByAddr[version->startPtr] = version;
+}
+
+/// Push a value on the stack
+inline void pushVal(Value val)
+{
+    stackPtr--;
+    stackPtr[0] = val;
+}
+
+inline void pushBool(bool val)
+{
+    pushVal(val? Value::TRUE:Value::FALSE);
+}
+
+inline Value popVal()
+{
+    assert (stackPtr < stackBottom);
+    auto val = stackPtr[0];
+    stackPtr++;
+    return val;
+}
+
+inline bool popBool()
+{
+    auto val = popVal();
+    if (!val.isBool())
+        throw RunError("op expects boolean value");
+    return (bool)val;
+}
+
+inline int64_t popInt64()
+{
+    auto val = popVal();
+    if (!val.isInt64())
+        throw RunError("op expects int64 value");
+    return (int64_t)val;
+}
+
+inline String popStr()
+{
+    auto val = popVal();
+    if (!val.isString())
+        throw RunError("op expects string value");
+    return String(val);
+}
+
+inline Array popArray()
+{
+    auto val = popVal();
+    if (!val.isArray())
+        throw RunError("op expects array value");
+    return Array(val);
+}
+
+inline Object popObj()
+{
+    auto val = popVal();
+    if (!val.isObject())
+        throw RunError("op expects object value");
+    return Object(val);
+}
+
+/// Get the code pointer for a block version, compiling it if needed
+inline uint8_t* getCodePtr(BlockVersion* version)
+{
+    if (!version->startPtr)
+        compile(version);
+
+    return version->startPtr;
+}
+
+void getFunInfo(
+    Object fun,
+    FunInfo& info,
+    const CodeGenCtx* argCtx = nullptr
+);
+
+/**
+Set up the stack frame for a function call. The arguments must have been
+pushed on the stack, first argument first. They become the first local
+variables of the callee, and are popped when the callee returns.
+
+Frame layout, from higher to lower addresses:
+  basePtr     -> local 0 (first argument)
+                 ...
+                 local n-1
+  framePtr    -> return address (continuation block version, or null
+                 when returning to the host)
+                 caller base pointer
+                 caller frame pointer
+  stackPtr    -> temporaries
+
+The bookkeeping slots are tagged TAG_RETADDR so that they are never
+mistaken for heap references.
+*/
+inline void pushFrame(
+    const FunInfo& info,
+    size_t numArgs,
+    BlockVersion* retVer
+)
+{
+    auto numLocals = info.numLocals;
+    assert (numArgs <= info.numParams);
+    assert (stackPtr + numArgs <= stackBottom);
+
+    // Stack pointer of the caller once the arguments are popped
+    auto argsEnd = stackPtr + numArgs;
+
+    auto newFramePtr = argsEnd - numLocals - 1;
+    auto newStackPtr = newFramePtr - (FRAME_INFO_SLOTS - 1);
+
+    if (newStackPtr < stackLimit)
+    {
+        throw RunError("stack overflow");
+    }
+
+    // Initialize the remaining local variables
+    for (auto localPtr = argsEnd - numArgs - 1; localPtr > newFramePtr; --localPtr)
+        *localPtr = Value::UNDEF;
+
+    newFramePtr[0] = Value((refptr)retVer, TAG_RETADDR);
+    newFramePtr[-1] = Value((refptr)basePtr, TAG_RETADDR);
+    newFramePtr[-2] = Value((refptr)framePtr, TAG_RETADDR);
+
+    // Local variable i is stored at basePtr[-i]
+    basePtr = argsEnd - 1;
+    framePtr = newFramePtr;
+    stackPtr = newStackPtr;
+}
+
+//
+// Operations shared by the interpreter and JIT-compiled code. These
+// take their operands from the stack and push their results on it.
+// Operations which allocate end with a GC safepoint, once the values
+// they work on are back on the stack.
+//
+
+inline void opStrLen()
+{
+    auto str = popStr();
+    pushVal((int64_t)str.length());
+}
+
+inline void opGetChar()
+{
+    auto idx = (size_t)popInt64();
+    auto str = popStr();
+
+    if (idx >= str.length())
+    {
+        throw RunError(
+            "get_char, index out of bounds"
+        );
+    }
+
+    auto ch = (unsigned char)str[idx];
+
+    // Cache single-character strings
+    if (charStrings[ch] == Value::FALSE)
+    {
+        char buf[2] = { (char)ch, '\0' };
+        charStrings[ch] = String(buf);
+    }
+
+    pushVal(charStrings[ch]);
+    vm.safepoint();
+}
+
+inline void opGetCharCode()
+{
+    auto idx = (size_t)popInt64();
+    auto str = popStr();
+
+    if (idx >= str.length())
+    {
+        throw RunError(
+            "get_char_code, index out of bounds"
+        );
+    }
+
+    pushVal((int64_t)str[idx]);
+}
+
+inline void opStrCat()
+{
+    auto a = popStr();
+    auto b = popStr();
+    auto c = String::concat(b, a);
+    pushVal(c);
+    vm.safepoint();
+}
+
+inline void opEqStr()
+{
+    auto arg1 = popStr();
+    auto arg0 = popStr();
+    pushBool(arg0 == arg1);
+}
+
+inline void opNewObject()
+{
+    auto capacity = popInt64();
+    auto obj = Object::newObject(capacity);
+    pushVal(obj);
+    vm.safepoint();
+}
+
+inline void opHasField(FieldCache& cache)
+{
+    auto fieldName = popStr();
+    auto obj = popObj();
+    pushBool(obj.hasField(fieldName, cache));
+}
+
+inline void opSetField(FieldCache& cache)
+{
+    auto val = popVal();
+    auto fieldName = popStr();
+    auto obj = popObj();
+
+    // A cache hit means the field already exists, so its name was
+    // validated when it was added
+    if (obj.setFieldCached(fieldName, val, cache))
+    {
+        vm.safepoint();
+        return;
+    }
+
+    if (!isValidIdent(fieldName))
+    {
+        throw RunError(
+            "invalid identifier in set_field \"" +
+            (std::string)fieldName + "\""
+        );
+    }
+
+    obj.setField(fieldName, val, cache);
+    vm.safepoint();
+}
+
+inline Value getFieldChecked(Object obj, String fieldName, FieldCache& cache)
+{
+    Value val;
+    if (!obj.getField(fieldName, val, cache))
+    {
+        throw RunError(
+            "get_field failed, missing field \"" +
+            (std::string)fieldName + "\""
+        );
+    }
+
+    return val;
+}
+
+inline void opGetField(FieldCache& cache)
+{
+    auto fieldName = popStr();
+    auto obj = popObj();
+    pushVal(getFieldChecked(obj, fieldName, cache));
+}
+
+// Allocate an object literal from the field values on the stack
+inline void opNewObjectLit(ObjLitCache* cache)
+{
+    auto obj = Object::newObject(*cache, stackPtr);
+    stackPtr += cache->names.size();
+    pushVal(obj);
+    vm.safepoint();
+}
+
+// Read a property, walking the prototype chain. This pushes the
+// value and true if it is found, otherwise the object and false, so
+// that the caller can fall back to a lookup which handles the other
+// cases, such as a proto field which is not an object.
+inline void opGetProp(PropCache& cache)
+{
+    auto propName = popStr();
+    auto obj = popObj();
+
+    Value val;
+    if (obj.getProp(propName, val, cache))
+    {
+        pushVal(val);
+        pushBool(true);
+    }
+    else
+    {
+        pushVal(obj);
+        pushBool(false);
+    }
+}
+
+inline void opEqObj()
+{
+    Value arg1 = popVal();
+    Value arg0 = popVal();
+    pushBool(arg0 == arg1);
+}
+
+inline void opNewArray()
+{
+    auto len = popInt64();
+    auto array = Array(len);
+    pushVal(array);
+    vm.safepoint();
+}
+
+inline void opArrayLen()
+{
+    auto arr = popArray();
+    pushVal((int64_t)arr.length());
+}
+
+inline void opArrayPush()
+{
+    auto val = popVal();
+    auto arr = popArray();
+    arr.push(val);
+    vm.safepoint();
+}
+
+inline void opSetElem()
+{
+    auto val = popVal();
+    auto idx = (size_t)popInt64();
+    auto arr = popArray();
+
+    if (idx >= arr.length())
+    {
+        throw RunError(
+            "set_elem, index out of bounds"
+        );
+    }
+
+    arr.setElem(idx, val);
+}
+
+inline void opGetElem()
+{
+    auto idx = (size_t)popInt64();
+    auto arr = popArray();
+
+    if (idx >= arr.length())
+    {
+        throw RunError(
+            "get_elem, index out of bounds"
+        );
+    }
+
+    pushVal(arr.getElem(idx));
+}
+
+inline void opEqBool()
+{
+    auto arg1 = popBool();
+    auto arg0 = popBool();
+    pushBool(arg0 == arg1);
+}
+
+inline void opGetTag()
+{
+    auto valTag = popVal().getTag();
+    pushVal(String(tagToStr(valTag)));
+}
+
+inline void opImport()
+{
+    auto pkgName = popStr();
+    auto pkg = import(pkgName);
+    pushVal(pkg);
+}
+
+void opAbort(SrcPos srcPos)
+{
+    auto errMsg = (std::string)popStr();
+
+    // If a source position was specified
+    if (srcPos.isValid())
+    {
+        std::cout << posToString(srcPos) << " - ";
+    }
+
+    if (errMsg != "")
+    {
+        std::cout << "aborting execution due to error: ";
+        std::cout << errMsg << std::endl;
+    }
+    else
+    {
+        std::cout << "aborting execution due to error" << std::endl;
+    }
+
+    exit(-1);
+}
+
+void throwArgCountError(SrcPos srcPos, size_t numArgs, size_t numParams)
+{
+    std::string srcPosStr = (
+        srcPos.isValid()?
+        (posToString(srcPos) + " - "):
+        std::string("")
+    );
+
+    throw RunError(
+        srcPosStr +
+        "incorrect argument count in call, received " +
+        std::to_string(numArgs) +
+        ", expected " +
+        std::to_string(numParams)
+    );
+}
+
+/// Call a host function with arguments on the stack, replacing
+/// the arguments with the return value
+void callHostFn(HostFn* hostFn, size_t numArgs)
+{
+    // Arguments are read directly from the stack,
+    // with the first argument deepest in the stack
+    auto args = stackPtr + numArgs - 1;
+
+    Value retVal;
+    switch (numArgs)
+    {
+        case 0:
+        retVal = hostFn->call0();
+        break;
+
+        case 1:
+        retVal = hostFn->call1(args[0]);
+        break;
+
+        case 2:
+        retVal = hostFn->call2(args[0], args[-1]);
+        break;
+
+        case 3:
+        retVal = hostFn->call3(args[0], args[-1], args[-2]);
+        break;
+
+        default:
+        assert (false);
+    }
+
+    // Pop the arguments and push the return value on the stack
+    stackPtr += numArgs;
+    pushVal(retVal);
+    vm.safepoint();
+}
+
+/**
+Perform a call. The callee and arguments must be on the stack. Returns
+the block version execution continues at, which is the callee entry for
+function objects, and the call continuation once a host function returns.
+*/
+inline BlockVersion* opCall(
+    LocalIdx numArgs,
+    BlockVersion* retVer,
+    SrcPos srcPos,
+    const CodeGenCtx* argCtx,
+    FunInfo& funInfo
+)
+{
+    auto callee = popVal();
+
+    if (stackPtr + numArgs > stackBottom)
+    {
+        throw RunError(
+            "stack underflow at call"
+        );
+    }
+
+    size_t numParams;
+    if (callee.isObject())
+    {
+        // If the callee differs from the cached one,
+        // update the call site cache
+        if ((refptr)callee != funInfo.fun)
+        {
+            callCacheMisses++;
+            getFunInfo(callee, funInfo, argCtx);
+
+            if (vm.inNursery(funInfo.fun))
+                youngCallees.push_back(&funInfo.fun);
+        }
+        else
+        {
+            callCacheHits++;
+        }
+
+        numParams = funInfo.numParams;
+    }
+    else if (callee.isHostFn())
+    {
+        auto hostFn = (HostFn*)(callee.getWord().ptr);
+        numParams = hostFn->getNumParams();
+    }
+    else
+    {
+        throw RunError("invalid callee at call site");
+    }
+
+    if (numArgs != numParams)
+    {
+        throwArgCountError(srcPos, numArgs, numParams);
+    }
+
+    // Plush function call, execution continues
+    // in the callee, without recursing on the host stack
+    if (callee.isObject())
+    {
+        pushFrame(funInfo, numArgs, retVer);
+        return funInfo.entryVer;
+    }
+
+    callHostFn((HostFn*)(callee.getWord().ptr), numArgs);
+
+    // Continue at the return basic block
+    return retVer;
+}
+
+/**
+Return from the current function. Returns the block version execution
+continues at in the caller, or null when returning to the host.
+*/
+inline BlockVersion* opRet(Value& retVal)
+{
+    retVal = popVal();
+    auto retVer = (BlockVersion*)framePtr[0].getWord().ptr;
+
+    // Pop the callee frame, including the arguments,
+    // and restore the caller's frame
+    stackPtr = basePtr + 1;
+    basePtr = (Value*)framePtr[-1].getWord().ptr;
+    framePtr = (Value*)framePtr[-2].getWord().ptr;
+
+    // Continue execution in the caller
+    if (retVer)
+        pushVal(retVal);
+
+    return retVer;
+}
+
+/// Start/continue execution beginning at a current instruction
+#if defined(THREADED_DISPATCH) && !defined(__clang__)
+// Stop GCC from merging the indirect jumps at the end of each handler
+// back into a single shared dispatch point
+__attribute__((optimize("no-crossjumping", "no-gcse")))
+#endif
+Value execCode(bool initHandlers)
+{
+#ifdef THREADED_DISPATCH
+    #define CASE(op) L_##op:
+    #define NEXT_INSTR { cycleCount++; goto *readVal<void*>(); }
+    #define HANDLER(op) opHandlers[op] = &&L_##op;
+
+    // Export the instruction handler addresses
+    if (initHandlers)
+    {
+        for (size_t i = 0; i < NUM_OPCODES; ++i)
+            opHandlers[i] = &&L_INVALID;
+
+        HANDLER(GET_LOCAL)
+        HANDLER(SET_LOCAL)
+        HANDLER(PUSH)
+        HANDLER(POP)
+        HANDLER(DUP)
+        HANDLER(SWAP)
+        HANDLER(ADD_I64)
+        HANDLER(SUB_I64)
+        HANDLER(MUL_I64)
+        HANDLER(LT_I64)
+        HANDLER(LE_I64)
+        HANDLER(GT_I64)
+        HANDLER(GE_I64)
+        HANDLER(EQ_I64)
+        HANDLER(STR_LEN)
+        HANDLER(GET_CHAR)
+        HANDLER(GET_CHAR_CODE)
+        HANDLER(STR_CAT)
+        HANDLER(EQ_STR)
+        HANDLER(NEW_OBJECT)
+        HANDLER(HAS_FIELD)
+        HANDLER(SET_FIELD)
+        HANDLER(GET_FIELD)
+        HANDLER(EQ_OBJ)
+        HANDLER(GET_PROP)
+        HANDLER(NEW_OBJECT_LIT)
+        HANDLER(EQ_BOOL)
+        HANDLER(HAS_TAG)
+        HANDLER(GET_TAG)
+        HANDLER(NEW_ARRAY)
+        HANDLER(ARRAY_LEN)
+        HANDLER(ARRAY_PUSH)
+        HANDLER(GET_ELEM)
+        HANDLER(SET_ELEM)
+        HANDLER(JUMP)
+        HANDLER(JUMP_STUB)
+        HANDLER(IF_TRUE)
+        HANDLER(IF_TRUE_STUB)
+        HANDLER(CALL)
+        HANDLER(RET)
+        HANDLER(IMPORT)
+        HANDLER(ABORT)
+        HANDLER(GET_LOCAL2)
+        HANDLER(GET_LOCAL_PUSH)
+        HANDLER(GET_FIELD_IMM)
+        HANDLER(CALL_IMM)
+        HANDLER(IF_LOCAL_HAS_TAG)
+        HANDLER(IF_LT_I64)
+        HANDLER(PROFILE_OP)
+
+        return Value::UNDEF;
+    }
+#else
+    #define CASE(op) case op:
+    #define NEXT_INSTR break;
+
+    // Handler addresses only exist with threaded dispatch
+    (void)initHandlers;
+#endif
+
+    assert (instrPtr >= codeHeap);
+    assert (instrPtr < codeHeapLimit);
+
+#ifdef THREADED_DISPATCH
+    // Each instruction handler jumps directly to the next one
+    NEXT_INSTR
+#else
+    // For each instruction to execute
+    for (;;)
+    {
+        cycleCount++;
+
+        auto op = readVal<Opcode>();
+
+        switch (op)
+        {
+#endif
+            // Read a local variable and push it on the stack
+            CASE(GET_LOCAL)
+            {
+                auto localIdx = readVal<LocalIdx>();
+                pushVal(basePtr[-(intptr_t)localIdx]);
+            }
+            NEXT_INSTR
+
+            // Set a local variable
+            CASE(SET_LOCAL)
+            {
+                auto localIdx = readVal<LocalIdx>();
+                basePtr[-(intptr_t)localIdx] = popVal();
+            }
+            NEXT_INSTR
+
+            CASE(PUSH)
+            {
+                pushVal(readVal<Value>());
+            }
+            NEXT_INSTR
+
+            CASE(POP)
+            {
+                popVal();
+            }
+            NEXT_INSTR
+
+            // Duplicate a value on the stack
+            CASE(DUP)
+            {
+                auto idx = readVal<LocalIdx>();
+                pushVal(stackPtr[idx]);
+            }
+            NEXT_INSTR
+
+            // Swap the topmost two stack elements
+            CASE(SWAP)
+            {
+                auto v0 = popVal();
+                auto v1 = popVal();
+                pushVal(v0);
+                pushVal(v1);
+            }
+            NEXT_INSTR
+
+            //
+            // 64-bit integer operations
+            //
+
+            CASE(ADD_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushVal(arg0 + arg1);
+            }
+            NEXT_INSTR
+
+            CASE(SUB_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushVal(arg0 - arg1);
+            }
+            NEXT_INSTR
+
+            CASE(MUL_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushVal(arg0 * arg1);
+            }
+            NEXT_INSTR
+
+            CASE(LT_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushBool(arg0 < arg1);
+            }
+            NEXT_INSTR
+
+            CASE(LE_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushBool(arg0 <= arg1);
+            }
+            NEXT_INSTR
+
+            CASE(GT_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushBool(arg0 > arg1);
+            }
+            NEXT_INSTR
+
+            CASE(GE_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushBool(arg0 >= arg1);
+            }
+            NEXT_INSTR
+
+            CASE(EQ_I64)
+            {
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                pushBool(arg0 == arg1);
+            }
+            NEXT_INSTR
+
+            //
+            // String operations
+            //
+
+            CASE(STR_LEN)
+            {
+                opStrLen();
+            }
+            NEXT_INSTR
+
+            CASE(GET_CHAR)
+            {
+                opGetChar();
+            }
+            NEXT_INSTR
+
+            CASE(GET_CHAR_CODE)
+            {
+                opGetCharCode();
+            }
+            NEXT_INSTR
+
+            CASE(STR_CAT)
+            {
+                opStrCat();
+            }
+            NEXT_INSTR
+
+            CASE(EQ_STR)
+            {
+                opEqStr();
+            }
+            NEXT_INSTR
+
+            //
+            // Object operations
+            //
+
+            CASE(NEW_OBJECT)
+            {
+                opNewObject();
+            }
+            NEXT_INSTR
+
+            CASE(HAS_FIELD)
+            {
+                opHasField(readRef<FieldCache>());
+            }
+            NEXT_INSTR
+
+            CASE(SET_FIELD)
+            {
+                opSetField(readRef<FieldCache>());
+            }
+            NEXT_INSTR
+
+            // This instruction will abort execution if trying to
+            // access a field that is not present on an object.
+            // The running program is responsible for testing that
+            // fields exist before attempting to read them.
+            CASE(GET_FIELD)
+            {
+                opGetField(readRef<FieldCache>());
+            }
+            NEXT_INSTR
+
+            CASE(GET_PROP)
+            {
+                opGetProp(readRef<PropCache>());
+            }
+            NEXT_INSTR
+
+            CASE(NEW_OBJECT_LIT)
+            {
+                opNewObjectLit(readVal<ObjLitCache*>());
+            }
+            NEXT_INSTR
+
+            CASE(EQ_OBJ)
+            {
+                opEqObj();
+            }
+            NEXT_INSTR
+
+            //
+            // Array operations
+            //
+
+            CASE(NEW_ARRAY)
+            {
+                opNewArray();
+            }
+            NEXT_INSTR
+
+            CASE(ARRAY_LEN)
+            {
+                opArrayLen();
+            }
+            NEXT_INSTR
+
+            CASE(ARRAY_PUSH)
+            {
+                opArrayPush();
+            }
+            NEXT_INSTR
+
+            CASE(SET_ELEM)
+            {
+                opSetElem();
+            }
+            NEXT_INSTR
+
+            CASE(GET_ELEM)
+            {
+                opGetElem();
+            }
+            NEXT_INSTR
+
+            //
+            // Miscellaneous
+            //
+
+            CASE(EQ_BOOL)
+            {
+                opEqBool();
+            }
+            NEXT_INSTR
+
+            // Test if a value has a given tag
+            CASE(HAS_TAG)
+            {
+                auto testTag = readVal<Tag>();
+                auto valTag = popVal().getTag();
+                pushBool(valTag == testTag);
+            }
+            NEXT_INSTR
+
+            // Get the type tag of a value as a string
+            CASE(GET_TAG)
+            {
+                opGetTag();
+            }
+            NEXT_INSTR
+
+            //
+            // Branch instructions
+            //
+
+            CASE(JUMP)
+            {
+                instrPtr = readVal<uint8_t*>();
+            }
+            NEXT_INSTR
+
+            // Jump to a block which may not yet be compiled
+            CASE(JUMP_STUB)
+            {
+                auto opPtr = instrPtr - sizeof(OpField);
+                auto target = readVal<BlockVersion*>();
+                auto codePtr = getCodePtr(target);
+
+                // Patch the stub into a direct jump
+                *(OpField*)opPtr = encodeOp(JUMP);
+                *(uint8_t**)(opPtr + sizeof(OpField)) = codePtr;
+
+                instrPtr = codePtr;
+            }
+            NEXT_INSTR
+
+            CASE(IF_TRUE)
+            {
+                auto thenPtr = readVal<uint8_t*>();
+                auto elsePtr = readVal<uint8_t*>();
+                auto arg0 = popBool();
+                instrPtr = arg0? thenPtr:elsePtr;
+            }
+            NEXT_INSTR
+
+            // Conditional branch with targets which may not yet be compiled
+            CASE(IF_TRUE_STUB)
+            {
+                auto opPtr = instrPtr - sizeof(OpField);
+                auto thenVer = readVal<BlockVersion*>();
+                auto elseVer = readVal<BlockVersion*>();
+                auto arg0 = popBool();
+
+                instrPtr = getCodePtr(arg0? thenVer:elseVer);
+
+                // Once both targets are compiled, patch the stub
+                // into a direct conditional branch
+                if (thenVer->startPtr && elseVer->startPtr)
+                {
+                    auto operands = (uint8_t**)(opPtr + sizeof(OpField));
+                    *(OpField*)opPtr = encodeOp(IF_TRUE);
+                    operands[0] = thenVer->startPtr;
+                    operands[1] = elseVer->startPtr;
+                }
+            }
+            NEXT_INSTR
+
+            // Regular function call
+            CASE(CALL)
+            {
+                auto numArgs = readVal<LocalIdx>();
+                auto retVer = readVal<BlockVersion*>();
+                auto srcPos = readVal<SrcPos>();
+                auto argCtx = readVal<const CodeGenCtx*>();
+                auto& funInfo = readRef<FunInfo>();
+
+                auto nextVer = opCall(numArgs, retVer, srcPos, argCtx, funInfo);
+                instrPtr = getCodePtr(nextVer);
+            }
+            NEXT_INSTR
+
+            CASE(RET)
+            {
+                Value retVal;
+                auto retVer = opRet(retVal);
+
+                // If returning to the host, stop executing
+                if (retVer == nullptr)
+                    return retVal;
+
+                instrPtr = getCodePtr(retVer);
+            }
+            NEXT_INSTR
+
+            CASE(IMPORT)
+            {
+                opImport();
+            }
+            NEXT_INSTR
+
+            CASE(ABORT)
+            {
+                opAbort(readVal<SrcPos>());
+            }
+            NEXT_INSTR
+
+            //
+            // Superinstructions
+            //
+
+            CASE(GET_LOCAL2)
+            {
+                auto idx0 = readVal<LocalIdx>();
+                auto idx1 = readVal<LocalIdx>();
+                pushVal(basePtr[-(intptr_t)idx0]);
+                pushVal(basePtr[-(intptr_t)idx1]);
+            }
+            NEXT_INSTR
+
+            CASE(GET_LOCAL_PUSH)
+            {
+                auto localIdx = readVal<LocalIdx>();
+                pushVal(basePtr[-(intptr_t)localIdx]);
+                pushVal(readVal<Value>());
+            }
+            NEXT_INSTR
+
+            CASE(GET_FIELD_IMM)
+            {
+                auto obj = Object(readVal<Value>());
+                auto fieldName = String(readVal<Value>());
+                auto& cache = readRef<FieldCache>();
+                pushVal(getFieldChecked(obj, fieldName, cache));
+            }
+            NEXT_INSTR
+
+            CASE(CALL_IMM)
+            {
+                pushVal(readVal<Value>());
+
+                auto numArgs = readVal<LocalIdx>();
+                auto retVer = readVal<BlockVersion*>();
+                auto srcPos = readVal<SrcPos>();
+                auto argCtx = readVal<const CodeGenCtx*>();
+                auto& funInfo = readRef<FunInfo>();
+
+                auto nextVer = opCall(numArgs, retVer, srcPos, argCtx, funInfo);
+                instrPtr = getCodePtr(nextVer);
+            }
+            NEXT_INSTR
+
+            CASE(IF_LOCAL_HAS_TAG)
+            {
+                auto localIdx = readVal<LocalIdx>();
+                auto testTag = readVal<Tag>();
+                auto thenVer = readVal<BlockVersion*>();
+                auto elseVer = readVal<BlockVersion*>();
+                auto valTag = basePtr[-(intptr_t)localIdx].getTag();
+                instrPtr = getCodePtr((valTag == testTag)? thenVer:elseVer);
+            }
+            NEXT_INSTR
+
+            CASE(IF_LT_I64)
+            {
+                auto thenVer = readVal<BlockVersion*>();
+                auto elseVer = readVal<BlockVersion*>();
+                auto arg1 = popInt64();
+                auto arg0 = popInt64();
+                instrPtr = getCodePtr((arg0 < arg1)? thenVer:elseVer);
+            }
+            NEXT_INSTR
+
+            CASE(PROFILE_OP)
+            {
+                profileOp(readVal<ProfileSite*>());
+            }
+            NEXT_INSTR
+
+#ifdef THREADED_DISPATCH
+    L_INVALID:
+    assert (false && "unhandled op in interpreter");
+#else
+            default:
+            assert (false && "unhandled op in interpreter");
+        }
+    }
+#endif
+
+    #undef CASE
+    #undef NEXT_INSTR
+    #undef HANDLER
+
+    assert (false);
+}
+
+/**
+Read the information needed to call a function. If the tags of the
+arguments at the call site are known, the entry block version is
+specialized for them.
+*/
+void getFunInfo(Object fun, FunInfo& info, const CodeGenCtx* argCtx)
+{
+    static ICache numParamsIC("num_params");
+    static ICache numLocalsIC("num_locals");
+    static ICache entryIC("entry");
+    auto numParams = numParamsIC.getInt64(fun);
+    auto numLocals = numLocalsIC.getInt64(fun);
+
+    if (numParams < 0 || numParams > numLocals)
+    {
+        throw RunError("invalid parameter or local variable count");
+    }
+
+    info.fun = (refptr)fun;
+    info.numParams = numParams;
+    info.numLocals = numLocals;
+
+    // Locals other than the parameters start out undefined
+    CodeGenCtx entryCtx;
+    for (auto i = numParams; i < numLocals; ++i)
+        entryCtx.setLocal(i, TAG_UNDEF);
+
+    if (argCtx)
+    {
+        for (LocalIdx i = 0; i < numParams; ++i)
+            entryCtx.setLocal(i, argCtx->getLocal(i));
+    }
+
+    // Functions may have a source position table
+    refptr posTable = nullptr;
+    if (fun.hasField("src_pos"))
+    {
+        auto table = fun.getField("src_pos");
+        if (table.isArray())
+            posTable = (refptr)table;
+    }
+
+    info.entryVer = getBlockVersion(entryIC.getObj(fun), entryCtx, posTable);
+}
+
+/// Forward the source position table and cached callee
+/// in the operands of a call instruction
+void forwardCallRefs(uint8_t* operands)
+{
+    operands += sizeof(LocalIdx) + sizeof(BlockVersion*);
+    auto& srcPos = *(SrcPos*)operands;
+    srcPos.table = vm.forward(srcPos.table);
+
+    operands += sizeof(SrcPos) + sizeof(const CodeGenCtx*);
+    auto& funInfo = *(FunInfo*)operands;
+    funInfo.fun = vm.forward(funInfo.fun);
+}
+
+/**
+Forward the heap references held by a block version, other than
+its block, which is the key of the version map
+*/
+void forwardVersionRefs(BlockVersion* version)
+{
+    version->posTable = vm.forward(version->posTable);
+
+    if (!version->startPtr)
+        return;
+
+    for (auto codePtr = version->startPtr; codePtr < version->endPtr;)
+    {
+        auto op = decodeOp(readCode<OpField>(codePtr));
+        auto operands = codePtr;
+        codePtr += operandSize(op);
+
+        switch (op)
+        {
+            case PUSH:
+            vm.forward(*(Value*)operands);
+            break;
+
+            case ABORT:
+            {
+                auto& srcPos = *(SrcPos*)operands;
+                srcPos.table = vm.forward(srcPos.table);
+            }
+            break;
+
+            case CALL:
+            forwardCallRefs(operands);
+            break;
+
+            case GET_LOCAL_PUSH:
+            vm.forward(*(Value*)(operands + sizeof(LocalIdx)));
+            break;
+
+            case GET_FIELD_IMM:
+            vm.forward(((Value*)operands)[0]);
+            vm.forward(((Value*)operands)[1]);
+            break;
+
+            case CALL_IMM:
+            vm.forward(*(Value*)operands);
+            forwardCallRefs(operands + sizeof(Value));
+            break;
+
+            default:
+            break;
+        }
+    }
+}
+
+/// Reinsert the versions of a block which moved under its new address
+void moveBlockVersions(refptr oldBlock, refptr newBlock)
+{
+    auto itr = versionMap.find(oldBlock);
+    auto versions = std::move(itr->second);
+    versionMap.erase(itr);
+
+    for (auto version : versions)
+        version->block = Object(Value(newBlock, TAG_OBJECT));
+
+    versionMap[newBlock] = std::move(versions);
+}
+
+/**
+Forward the heap references held by the interpreter during a collection.
+These are the values on the stack, the blocks and position tables of
+block versions, and the constants, source positions and callees in the
+code heap. Minor collections only scan the versions created or compiled
+since the last collection, and the call sites which received a nursery
+callee, since no other part of the code heap refers to the nursery.
+Field and property caches only refer to pinned interned strings, which
+never move and are never freed. Block versions are never freed, so the
+blocks they were compiled from are kept alive.
+*/
+void forwardInterpRefs()
+{
+    for (auto valPtr = stackPtr; valPtr < stackBottom; ++valPtr)
+        vm.forward(*valPtr);
+
+    if (vm.isMinorGC())
+    {
+        for (auto calleePtr : youngCallees)
+            *calleePtr = vm.forward(*calleePtr);
+
+        for (auto version : youngVersions)
+        {
+            auto block = (refptr)version->block;
+            if (vm.inNursery(block))
+                moveBlockVersions(block, vm.forward(block));
+
+            forwardVersionRefs(version);
+        }
+    }
+    else
+    {
+        // Blocks which moved are reinserted after the walk
+        std::vector<std::pair<refptr, refptr>> movedBlocks;
+
+        for (auto& pair : versionMap)
+        {
+            auto block = vm.forward(pair.first);
+            if (block != pair.first)
+                movedBlocks.push_back(std::make_pair(pair.first, block));
+
+            for (auto version : pair.second)
+                forwardVersionRefs(version);
+        }
+
+        for (auto& move : movedBlocks)
+            moveBlockVersions(move.first, move.second);
+    }
+
+    // All nursery objects have been promoted
+    youngVersions.clear();
+    youngCallees.clear();
+
+    for (auto site : profileSites)
+        site->srcPos.table = vm.forward(site->srcPos.table);
+
+    // Block names are only recorded while profiling allocations,
+    // the named blocks are kept alive for the profile to be complete
+    if (!blockNames.empty())
+    {
+        std::unordered_map<refptr, std::string> newBlockNames;
+        for (auto& pair : blockNames)
+            newBlockNames[vm.forward(pair.first)] = std::move(pair.second);
+        blockNames = std::move(newBlockNames);
+    }
+}
+
+//============================================================================
+// JIT compiler
+//============================================================================
+
+/*
+The baseline JIT translates the bytecode of block versions into x86-64
+machine code. Simple stack and integer operations are compiled inline,
+and everything else calls into the same C++ operations the interpreter
+uses. Branches to versions without machine code go through stubs which
+compile the target and patch themselves into direct jumps.
+
+Register usage in JIT-compiled code:
+  rbx   temporary stack pointer (stackPtr)
+  r12   frame base pointer (basePtr)
+  rax, rcx, rdi, rsi, xmm0, xmm1 are scratch registers
+
+The stack pointer is written back to stackPtr before calling C++ code,
+and reloaded after, so that C++ code always sees the current stack.
+*/
+
+#ifdef HAVE_JIT
+
+/// Machine code heap size in bytes
+const size_t JIT_HEAP_INIT_SIZE = 1 << 26;
+
+/// Executable memory region for machine code
+uint8_t* jitHeap = nullptr;
+uint8_t* jitHeapLimit = nullptr;
+uint8_t* jitHeapAlloc = nullptr;
+
+/// Entry trampoline, called as a C function with the code to run
+void (*jitEnter)(uint8_t* codePtr) = nullptr;
+
+/// Exit point of the entry trampoline, jumped to in order to
+/// return to jitRun()
+uint8_t* jitExitPtr = nullptr;
+
+/// Return value when returning to the host
+Value jitRetVal;
+
+/// Exception raised in C++ code called from machine code
+std::exception_ptr jitException;
+
+/// Register numbers
+const uint8_t RAX = 0;
+const uint8_t RCX = 1;
+const uint8_t RSP = 4;
+const uint8_t RBX = 3;
+const uint8_t RSI = 6;
+const uint8_t RDI = 7;
+const uint8_t R12 = 12;
+
+/// Condition codes
+const uint8_t CC_E = 0x4;
+const uint8_t CC_NE = 0x5;
+const uint8_t CC_L = 0xC;
+const uint8_t CC_GE = 0xD;
+const uint8_t CC_LE = 0xE;
+const uint8_t CC_G = 0xF;
+
+/// Offset of the tag within a Value
+const int32_t TAG_OFS = 8;
+
+/// Size of a Value in bytes
+const int32_t VAL_SIZE = sizeof(Value);
+
+template <typename T> void jitVal(T val)
+{
+    if (jitHeapAlloc + sizeof(T) > jitHeapLimit)
+        throw RunError("machine code heap exhausted");
+
+    *(T*)jitHeapAlloc = val;
+    jitHeapAlloc += sizeof(T);
+}
+
+void jitBytes(std::initializer_list<uint8_t> bytes)
+{
+    for (auto byte : bytes)
+        jitVal(byte);
+}
+
+/// Write a REX prefix, if needed
+void jitRex(bool wide, uint8_t reg, uint8_t base)
+{
+    uint8_t rex = 0x40 | (wide? 8:0) | ((reg >> 3) << 2) | (base >> 3);
+    if (rex != 0x40)
+        jitVal(rex);
+}
+
+/// Write a ModRM byte for a register and a [base + disp32] operand
+void jitMem(uint8_t reg, uint8_t base, int32_t disp)
+{
+    jitVal<uint8_t>(0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+        jitVal<uint8_t>(0x24);
+    jitVal(disp);
+}
+
+/// mov reg, imm64
+void jitMovImm(uint8_t reg, uint64_t imm)
+{
+    jitRex(true, 0, reg);
+    jitVal<uint8_t>(0xB8 + (reg & 7));
+    jitVal(imm);
+}
+
+/// Instruction with a 64-bit register and a memory operand
+void jitRegMem(uint8_t opcode, uint8_t reg, uint8_t base, int32_t disp)
+{
+    jitRex(true, reg, base);
+    jitVal(opcode);
+    jitMem(reg, base, disp);
+}
+
+/// mov qword [base + disp], imm32
+void jitStoreImm(uint8_t base, int32_t disp, int32_t imm)
+{
+    jitRex(true, 0, base);
+    jitVal<uint8_t>(0xC7);
+    jitMem(0, base, disp);
+    jitVal(imm);
+}
+
+/// Copy a value between the stack or locals and an xmm register
+void jitLoadVal(uint8_t xmm, uint8_t base, int32_t disp)
+{
+    jitRex(false, xmm, base);
+    jitBytes({ 0x0F, 0x10 });
+    jitMem(xmm, base, disp);
+}
+
+void jitStoreVal(uint8_t base, int32_t disp, uint8_t xmm)
+{
+    jitRex(false, xmm, base);
+    jitBytes({ 0x0F, 0x11 });
+    jitMem(xmm, base, disp);
+}
+
+/// Adjust the stack pointer by a number of values
+void jitPopVals(int32_t numVals)
+{
+    // add rbx, imm32
+    jitBytes({ 0x48, 0x81, 0xC3 });
+    jitVal(numVals * VAL_SIZE);
+}
+
+void jitPushVal()
+{
+    // sub rbx, imm32
+    jitBytes({ 0x48, 0x81, 0xEB });
+    jitVal(VAL_SIZE);
+}
+
+/// cmp byte [rbx + disp], tag
+void jitCmpTag(int32_t disp, Tag tag)
+{
+    jitVal<uint8_t>(0x80);
+    jitMem(7, RBX, disp);
+    jitVal(tag);
+}
+
+/// Conditional jump with a 32-bit displacement to be patched,
+/// returns the displacement location
+uint8_t* jitJcc(uint8_t cc)
+{
+    jitBytes({ 0x0F, (uint8_t)(0x80 + cc) });
+    auto dispPtr = jitHeapAlloc;
+    jitVal<int32_t>(0);
+    return dispPtr;
+}
+
+/// Patch a 32-bit jump displacement to point to a target
+void jitPatchRel(uint8_t* dispPtr, uint8_t* target)
+{
+    *(int32_t*)dispPtr = (int32_t)(target - (dispPtr + 4));
+}
+
+/// Write the stack pointer back to stackPtr
+void jitSaveStack()
+{
+    jitMovImm(RCX, (uint64_t)&stackPtr);
+    jitRegMem(0x89, RBX, RCX, 0);
+}
+
+/// Reload the stack and frame registers from stackPtr and basePtr
+void jitLoadStack(bool loadBase)
+{
+    jitMovImm(RCX, (uint64_t)&stackPtr);
+    jitRegMem(0x8B, RBX, RCX, 0);
+
+    if (loadBase)
+    {
+        jitMovImm(RCX, (uint64_t)&basePtr);
+        jitRegMem(0x8B, R12, RCX, 0);
+    }
+}
+
+/// Call a C++ function, the arguments being set up by the caller
+void jitCallFn(void* fnPtr)
+{
+    // mov rax, fnPtr; call rax
+    jitMovImm(RAX, (uint64_t)fnPtr);
+    jitBytes({ 0xFF, 0xD0 });
+}
+
+void jitJmpRax()
+{
+    jitBytes({ 0xFF, 0xE0 });
+}
+
+/// Record the exception being handled, and get the exit point
+/// JIT-compiled code must jump to so that it gets rethrown
+uint8_t* jitError()
+{
+    jitException = std::current_exception();
+    return jitExitPtr;
+}
+
+void jitCompile(BlockVersion* version);
+
+/// Get the machine code for a block version, compiling it if needed
+uint8_t* getJitCode(BlockVersion* version)
+{
+    if (!version->jitCode.startPtr)
+    {
+        getCodePtr(version);
+        jitCompile(version);
+    }
+
+    return version->jitCode.startPtr;
+}
+
+/// Compile the target of a branch stub and patch the stub
+/// into a direct jump
+uint8_t* jitBranchStub(BlockVersion* target, uint8_t* stubPtr)
+{
+    try
+    {
+        auto codePtr = getJitCode(target);
+
+        // jmp rel32
+        stubPtr[0] = 0xE9;
+        jitPatchRel(stubPtr + 1, codePtr);
+
+        return codePtr;
+    }
+    catch (...)
+    {
+        return jitError();
+    }
+}
 
-                stack.push_back(charStrings[ch]);
-            }
-            break;
+/// Execute an operation which is not compiled inline. Returns null
+/// on success, or the exit point if an exception was raised.
+uint8_t* jitExecOp(uint8_t* operands, Opcode op)
+{
+    // Machine code does not maintain the instruction pointer, it is
+    // set for the allocation profiler to find the instruction
+    auto prevInstrPtr = instrPtr;
+    instrPtr = operands + operandSize(op);
 
-            case GET_CHAR_CODE:
-            {
-                auto idx = (size_t)popInt64();
-                auto str = popStr();
+    try
+    {
+        switch (op)
+        {
+            case STR_LEN: opStrLen(); break;
+            case GET_CHAR: opGetChar(); break;
+            case GET_CHAR_CODE: opGetCharCode(); break;
+            case STR_CAT: opStrCat(); break;
+            case EQ_STR: opEqStr(); break;
+            case NEW_OBJECT: opNewObject(); break;
+            case HAS_FIELD: opHasField(*(FieldCache*)operands); break;
+            case SET_FIELD: opSetField(*(FieldCache*)operands); break;
+            case GET_FIELD: opGetField(*(FieldCache*)operands); break;
+            case EQ_OBJ: opEqObj(); break;
+            case GET_PROP: opGetProp(*(PropCache*)operands); break;
+            case NEW_OBJECT_LIT: opNewObjectLit(*(ObjLitCache**)operands); break;
+            case NEW_ARRAY: opNewArray(); break;
+            case ARRAY_LEN: opArrayLen(); break;
+            case ARRAY_PUSH: opArrayPush(); break;
+            case SET_ELEM: opSetElem(); break;
+            case GET_ELEM: opGetElem(); break;
+            case EQ_BOOL: opEqBool(); break;
+            case GET_TAG: opGetTag(); break;
+            case IMPORT: opImport(); break;
+            case ABORT: opAbort(*(SrcPos*)operands); break;
 
-                if (idx >= str.length())
-                {
-                    throw RunError(
-                        "get_char_code, index out of bounds"
-                    );
-                }
+            default:
+            assert (false && "unhandled op in jitExecOp");
+        }
 
-                stack.push_back((int64_t)str[idx]);
-            }
-            break;
+        instrPtr = prevInstrPtr;
+        return nullptr;
+    }
+    catch (...)
+    {
+        instrPtr = prevInstrPtr;
+        return jitError();
+    }
+}
 
-            case STR_CAT:
-            {
-                auto a = popStr();
-                auto b = popStr();
-                auto c = String::concat(b, a);
-                stack.push_back(c);
-            }
-            break;
+/// Perform a call from machine code, returns the code to continue at
+uint8_t* jitCall(uint8_t* operands)
+{
+    // Host functions may allocate, see jitExecOp
+    auto prevInstrPtr = instrPtr;
+    instrPtr = operands + operandSize(CALL);
 
-            case EQ_STR:
-            {
-                auto arg1 = popStr();
-                auto arg0 = popStr();
-                pushBool(arg0 == arg1);
-            }
-            break;
+    try
+    {
+        auto numArgs = *(LocalIdx*)operands;
+        operands += sizeof(LocalIdx);
+        auto retVer = *(BlockVersion**)operands;
+        operands += sizeof(BlockVersion*);
+        auto srcPos = *(SrcPos*)operands;
+        operands += sizeof(SrcPos);
+        auto argCtx = *(const CodeGenCtx**)operands;
+        operands += sizeof(const CodeGenCtx*);
+        auto& funInfo = *(FunInfo*)operands;
+
+        auto nextVer = opCall(numArgs, retVer, srcPos, argCtx, funInfo);
+        instrPtr = prevInstrPtr;
+        return getJitCode(nextVer);
+    }
+    catch (...)
+    {
+        instrPtr = prevInstrPtr;
+        return jitError();
+    }
+}
 
-            //
-            // Object operations
-            //
+/// Return from machine code, returns the code to continue at
+uint8_t* jitRet()
+{
+    try
+    {
+        Value retVal;
+        auto retVer = opRet(retVal);
 
-            case NEW_OBJECT:
-            {
-                auto capacity = popInt64();
-                auto obj = Object::newObject(capacity);
-                stack.push_back(obj);
-            }
-            break;
+        // If returning to the host, leave JIT-compiled code
+        if (retVer == nullptr)
+        {
+            jitRetVal = retVal;
+            return jitExitPtr;
+        }
 
-            case HAS_FIELD:
-            {
-                auto fieldName = popStr();
-                auto obj = popObj();
-                pushBool(obj.hasField(fieldName));
-            }
-            break;
+        return getJitCode(retVer);
+    }
+    catch (...)
+    {
+        return jitError();
+    }
+}
 
-            case SET_FIELD:
-            {
-                auto val = popVal();
-                auto fieldName = popStr();
-                auto obj = popObj();
+/// Raise the error for an integer operation on a non-integer value
+uint8_t* jitInt64Error()
+{
+    try
+    {
+        throw RunError("op expects int64 value");
+    }
+    catch (...)
+    {
+        return jitError();
+    }
+}
 
-                if (!isValidIdent(fieldName))
-                {
-                    throw RunError(
-                        "invalid identifier in set_field \"" +
-                        (std::string)fieldName + "\""
-                    );
-                }
+/// Raise the error for a branch on a non-boolean value
+uint8_t* jitBoolError()
+{
+    try
+    {
+        throw RunError("op expects boolean value");
+    }
+    catch (...)
+    {
+        return jitError();
+    }
+}
 
-                obj.setField(fieldName, val);
-            }
-            break;
+/// Compile a jump to a block version
+void jitJumpTo(BlockVersion* target)
+{
+    // If the target is already compiled, jump to it directly
+    if (target->jitCode.startPtr)
+    {
+        jitVal<uint8_t>(0xE9);
+        jitVal<int32_t>(0);
+        jitPatchRel(jitHeapAlloc - 4, target->jitCode.startPtr);
+        return;
+    }
 
-            // This instruction will abort execution if trying to
-            // access a field that is not present on an object.
-            // The running program is responsible for testing that
-            // fields exist before attempting to read them.
-            case GET_FIELD:
-            {
-                auto fieldName = popStr();
-                auto obj = popObj();
+    // Otherwise, call the stub, which overwrites its
+    // first instruction with a jump to the target
+    auto stubPtr = jitHeapAlloc;
+    jitMovImm(RDI, (uint64_t)target);
+    jitMovImm(RSI, (uint64_t)stubPtr);
+    jitCallFn((void*)jitBranchStub);
+    jitJmpRax();
+}
 
-                //std::cout << "get " << std::string(fieldName) << std::endl;
+/// Push a local variable on the stack
+void jitGetLocal(LocalIdx idx)
+{
+    jitLoadVal(0, R12, -(int32_t)idx * VAL_SIZE);
+    jitPushVal();
+    jitStoreVal(RBX, 0, 0);
+}
 
-                if (!obj.hasField(fieldName))
-                {
-                    throw RunError(
-                        "get_field failed, missing field \"" +
-                        (std::string)fieldName + "\""
-                    );
-                }
+/// Push a constant value on the stack, given its location in the
+/// code heap. Heap references are loaded from there, rather than
+/// embedded in the machine code, since the collector updates them.
+void jitPushImm(const Value* valPtr)
+{
+    auto val = *valPtr;
 
-                auto val = obj.getField(fieldName);
-                stack.push_back(val);
-            }
+    if (val.isPointer())
+    {
+        jitMovImm(RCX, (uint64_t)valPtr);
+        jitLoadVal(0, RCX, 0);
+        jitPushVal();
+        jitStoreVal(RBX, 0, 0);
+        return;
+    }
+
+    jitPushVal();
+    jitMovImm(RAX, (uint64_t)val.getWord().int64);
+    jitRegMem(0x89, RAX, RBX, 0);
+    jitStoreImm(RBX, TAG_OFS, val.getTag());
+}
+
+/// Compile an int64 arithmetic or comparison operation. Jumps
+/// to the type error are added to errorJumps.
+void jitInt64Op(Opcode op, std::vector<uint8_t*>& errorJumps)
+{
+    jitCmpTag(TAG_OFS, TAG_INT64);
+    errorJumps.push_back(jitJcc(CC_NE));
+    jitCmpTag(VAL_SIZE + TAG_OFS, TAG_INT64);
+    errorJumps.push_back(jitJcc(CC_NE));
+
+    // rax = arg0
+    jitRegMem(0x8B, RAX, RBX, VAL_SIZE);
+
+    if (op == ADD_I64 || op == SUB_I64 || op == MUL_I64)
+    {
+        // add/sub/imul rax, arg1
+        if (op == ADD_I64)
+            jitRegMem(0x03, RAX, RBX, 0);
+        else if (op == SUB_I64)
+            jitRegMem(0x2B, RAX, RBX, 0);
+        else
+        {
+            jitBytes({ 0x48, 0x0F, 0xAF });
+            jitMem(RAX, RBX, 0);
+        }
+
+        // The result replaces arg0, which has the int64 tag
+        jitPopVals(1);
+        jitRegMem(0x89, RAX, RBX, 0);
+        return;
+    }
+
+    uint8_t cc;
+    switch (op)
+    {
+        case LT_I64: cc = CC_L; break;
+        case LE_I64: cc = CC_LE; break;
+        case GT_I64: cc = CC_G; break;
+        case GE_I64: cc = CC_GE; break;
+        default: cc = CC_E;
+    }
+
+    // cmp rax, arg1; setcc al; movzx eax, al
+    jitRegMem(0x3B, RAX, RBX, 0);
+    jitBytes({ 0x0F, (uint8_t)(0x90 + cc), 0xC0 });
+    jitBytes({ 0x0F, 0xB6, 0xC0 });
+
+    jitPopVals(1);
+    jitRegMem(0x89, RAX, RBX, 0);
+    jitStoreImm(RBX, TAG_OFS, TAG_BOOL);
+}
+
+/// Compile a conditional branch on the value at the stack top
+void jitIfTrue(
+    BlockVersion* thenVer,
+    BlockVersion* elseVer,
+    std::vector<uint8_t*>& errorJumps
+)
+{
+    jitCmpTag(TAG_OFS, TAG_BOOL);
+    errorJumps.push_back(jitJcc(CC_NE));
+    // cmp qword [rbx], 1
+    jitRex(true, 0, RBX);
+    jitVal<uint8_t>(0x83);
+    jitMem(7, RBX, 0);
+    jitVal<uint8_t>(1);
+    auto notTrue = jitJcc(CC_NE);
+
+    jitPopVals(1);
+    jitJumpTo(thenVer);
+
+    jitPatchRel(notTrue, jitHeapAlloc);
+    jitPopVals(1);
+    jitJumpTo(elseVer);
+}
+
+/// Compile an operation implemented in C++
+void jitExecOpCall(Opcode op, uint8_t* operands)
+{
+    jitSaveStack();
+    jitMovImm(RDI, (uint64_t)operands);
+    jitMovImm(RSI, op);
+    jitCallFn((void*)jitExecOp);
+
+    // If an exception was raised, leave JIT-compiled code
+    // test rax, rax; jz +2; jmp rax
+    jitBytes({ 0x48, 0x85, 0xC0, 0x74, 0x02 });
+    jitJmpRax();
+
+    jitLoadStack(false);
+}
+
+/// Compile a call or return, which continues at the code address
+/// returned by the helper function
+void jitCallRet(void* helperFn, uint8_t* operands)
+{
+    jitSaveStack();
+    jitMovImm(RDI, (uint64_t)operands);
+    jitCallFn(helperFn);
+    jitLoadStack(true);
+    jitJmpRax();
+}
+
+/// Compile the bytecode of a block version into machine code
+void jitCompile(BlockVersion* version)
+{
+    auto& jitCode = version->jitCode;
+    jitCode.startPtr = jitHeapAlloc;
+
+    // Jumps to the errors raised on type check failures
+    std::vector<uint8_t*> int64ErrorJumps;
+    std::vector<uint8_t*> boolErrorJumps;
+
+    auto codePtr = version->startPtr;
+
+    while (codePtr < version->endPtr)
+    {
+        auto op = decodeOp(readCode<OpField>(codePtr));
+        auto operands = codePtr;
+        codePtr += operandSize(op);
+
+        switch (op)
+        {
+            case GET_LOCAL:
+            jitGetLocal(*(LocalIdx*)operands);
             break;
 
-            case EQ_OBJ:
+            case SET_LOCAL:
             {
-                Value arg1 = popVal();
-                Value arg0 = popVal();
-                pushBool(arg0 == arg1);
+                auto idx = *(LocalIdx*)operands;
+                jitLoadVal(0, RBX, 0);
+                jitPopVals(1);
+                jitStoreVal(R12, -(int32_t)idx * VAL_SIZE, 0);
             }
             break;
 
-            //
-            // Array operations
-            //
-
-            case NEW_ARRAY:
-            {
-                auto len = popInt64();
-                auto array = Array(len);
-                stack.push_back(array);
-            }
+            case PUSH:
+            jitPushImm((Value*)operands);
             break;
 
-            case ARRAY_LEN:
-            {
-                auto arr = Array(popVal());
-                stack.push_back(arr.length());
-            }
+            case POP:
+            jitPopVals(1);
             break;
 
-            case ARRAY_PUSH:
+            case DUP:
             {
-                auto val = popVal();
-                auto arr = Array(popVal());
-                arr.push(val);
+                auto idx = *(LocalIdx*)operands;
+                jitLoadVal(0, RBX, (int32_t)idx * VAL_SIZE);
+                jitPushVal();
+                jitStoreVal(RBX, 0, 0);
             }
             break;
 
-            case SET_ELEM:
-            {
-                auto val = popVal();
-                auto idx = (size_t)popInt64();
-                auto arr = Array(popVal());
-
-                if (idx >= arr.length())
-                {
-                    throw RunError(
-                        "set_elem, index out of bounds"
-                    );
-                }
+            case SWAP:
+            jitLoadVal(0, RBX, 0);
+            jitLoadVal(1, RBX, VAL_SIZE);
+            jitStoreVal(RBX, 0, 1);
+            jitStoreVal(RBX, VAL_SIZE, 0);
+            break;
 
-                arr.setElem(idx, val);
-            }
+            case ADD_I64:
+            case SUB_I64:
+            case MUL_I64:
+            case LT_I64:
+            case LE_I64:
+            case GT_I64:
+            case GE_I64:
+            case EQ_I64:
+            jitInt64Op(op, int64ErrorJumps);
             break;
 
-            case GET_ELEM:
+            case HAS_TAG:
             {
-                auto idx = (size_t)popInt64();
-                auto arr = Array(popVal());
+                auto tag = *(Tag*)operands;
 
-                if (idx >= arr.length())
-                {
-                    throw RunError(
-                        "get_elem, index out of bounds"
-                    );
-                }
+                // cmp tag; sete al; movzx eax, al
+                jitCmpTag(TAG_OFS, tag);
+                jitBytes({ 0x0F, 0x94, 0xC0 });
+                jitBytes({ 0x0F, 0xB6, 0xC0 });
 
-                stack.push_back(arr.getElem(idx));
+                jitRegMem(0x89, RAX, RBX, 0);
+                jitStoreImm(RBX, TAG_OFS, TAG_BOOL);
             }
             break;
 
-            case EQ_BOOL:
-            {
-                auto arg1 = popBool();
-                auto arg0 = popBool();
-                pushBool(arg0 == arg1);
-            }
+            case JUMP_STUB:
+            jitJumpTo(*(BlockVersion**)operands);
             break;
 
-            // Test if a value has a given tag
-            case HAS_TAG:
+            case IF_TRUE_STUB:
+            case IF_LT_I64:
             {
-                auto tag = popVal().getTag();
-                static ICache tagIC("tag");
-                auto tagStr = tagIC.getStr(instr);
+                auto targets = (BlockVersion**)operands;
 
-                switch (tag)
-                {
-                    case TAG_UNDEF:
-                    pushBool(tagStr == "undef");
-                    break;
+                if (op == IF_LT_I64)
+                    jitInt64Op(LT_I64, int64ErrorJumps);
 
-                    case TAG_BOOL:
-                    pushBool(tagStr == "bool");
-                    break;
+                jitIfTrue(targets[0], targets[1], boolErrorJumps);
+            }
+            break;
 
-                    case TAG_INT64:
-                    pushBool(tagStr == "int64");
-                    break;
+            case CALL:
+            jitCallRet((void*)jitCall, operands);
+            break;
 
-                    case TAG_STRING:
-                    pushBool(tagStr == "string");
-                    break;
+            case RET:
+            jitCallRet((void*)jitRet, nullptr);
+            break;
 
-                    case TAG_ARRAY:
-                    pushBool(tagStr == "array");
-                    break;
+            case GET_LOCAL2:
+            jitGetLocal(((LocalIdx*)operands)[0]);
+            jitGetLocal(((LocalIdx*)operands)[1]);
+            break;
 
-                    case TAG_OBJECT:
-                    pushBool(tagStr == "object");
-                    break;
+            case GET_LOCAL_PUSH:
+            jitGetLocal(*(LocalIdx*)operands);
+            jitPushImm((Value*)(operands + sizeof(LocalIdx)));
+            break;
 
-                    default:
-                    throw RunError(
-                        "unknown value type in has_tag"
-                    );
-                }
-            }
+            case GET_FIELD_IMM:
+            jitPushImm((Value*)operands);
+            jitPushImm((Value*)operands + 1);
+            jitExecOpCall(GET_FIELD, operands + 2 * sizeof(Value));
             break;
 
-            case JUMP:
-            {
-                static ICache icache("to");
-                auto target = icache.getObj(instr);
-                branchTo(target);
-            }
+            case CALL_IMM:
+            jitPushImm((Value*)operands);
+            jitCallRet((void*)jitCall, operands + sizeof(Value));
             break;
 
-            case IF_TRUE:
+            case IF_LOCAL_HAS_TAG:
             {
-                static ICache thenCache("then");
-                static ICache elseCache("else");
-                auto thenBB = thenCache.getObj(instr);
-                auto elseBB = elseCache.getObj(instr);
-                auto arg0 = popVal();
-                branchTo((arg0 == Value::TRUE)? thenBB:elseBB);
+                auto idx = *(LocalIdx*)operands;
+                auto tag = *(Tag*)(operands + sizeof(LocalIdx));
+                auto targets = (BlockVersion**)(operands + sizeof(LocalIdx) + sizeof(Tag));
+
+                // cmp byte [r12 + tag offset], tag
+                jitRex(false, 0, R12);
+                jitVal<uint8_t>(0x80);
+                jitMem(7, R12, -(int32_t)idx * VAL_SIZE + TAG_OFS);
+                jitVal(tag);
+                auto notTag = jitJcc(CC_NE);
+
+                jitJumpTo(targets[0]);
+                jitPatchRel(notTag, jitHeapAlloc);
+                jitJumpTo(targets[1]);
             }
             break;
 
-            // Regular function call
-            case CALL:
-            {
-                static ICache retToCache("ret_to");
-                static ICache numArgsCache("num_args");
-                auto retToBB = retToCache.getObj(instr);
-                auto numArgs = numArgsCache.getInt64(instr);
-
-                auto callee = popVal();
-
-                if (stack.size() < numArgs)
-                {
-                    throw RunError(
-                        "stack underflow at call"
-                    );
-                }
-
-                // Copy the arguments into a vector
-                ValueVec args;
-                args.resize(numArgs);
-                for (size_t i = 0; i < numArgs; ++i)
-                    args[numArgs - 1 - i] = popVal();
-
-                static ICache numParamsIC("num_params");
-                size_t numParams;
-                if (callee.isObject())
-                {
-                    numParams = numParamsIC.getInt64(callee);
-                }
-                else if (callee.isHostFn())
-                {
-                    auto hostFn = (HostFn*)(callee.getWord().ptr);
-                    numParams = hostFn->getNumParams();
-                }
-                else
-                {
-                    throw RunError("invalid callee at call site");
-                }
-
-                if (numArgs != numParams)
-                {
-                    std::string srcPosStr = (
-                        instr.hasField("src_pos")?
-                        (posToString(instr.getField("src_pos")) + " - "):
-                        std::string("")
-                    );
-
-                    throw RunError(
-                        srcPosStr +
-                        "incorrect argument count in call, received " +
-                        std::to_string(numArgs) +
-                        ", expected " +
-                        std::to_string(numParams)
-                    );
-                }
-
-                Value retVal;
+            // Operations implemented in C++
+            default:
+            assert (!isBranch(op));
+            jitExecOpCall(op, operands);
+            break;
+        }
+    }
 
-                if (callee.isObject())
-                {
-                    // Perform the call
-                    retVal = call(callee, args);
-                }
-                else if (callee.isHostFn())
-                {
-                    auto hostFn = (HostFn*)(callee.getWord().ptr);
+    if (int64ErrorJumps.size() > 0)
+    {
+        for (auto dispPtr : int64ErrorJumps)
+            jitPatchRel(dispPtr, jitHeapAlloc);
 
-                    // Call the host function
-                    switch (numArgs)
-                    {
-                        case 0:
-                        retVal = hostFn->call0();
-                        break;
+        jitCallFn((void*)jitInt64Error);
+        jitJmpRax();
+    }
 
-                        case 1:
-                        retVal = hostFn->call1(args[0]);
-                        break;
+    if (boolErrorJumps.size() > 0)
+    {
+        for (auto dispPtr : boolErrorJumps)
+            jitPatchRel(dispPtr, jitHeapAlloc);
 
-                        case 2:
-                        retVal = hostFn->call2(args[0], args[1]);
-                        break;
+        jitCallFn((void*)jitBoolError);
+        jitJmpRax();
+    }
 
-                        case 3:
-                        retVal = hostFn->call3(args[0], args[1], args[2]);
-                        break;
+    jitCode.endPtr = jitHeapAlloc;
+}
 
-                        default:
-                        assert (false);
-                    }
-                }
+/// Allocate the machine code heap and generate the entry trampoline
+void initJit()
+{
+    // Tags are read from the second word of each value
+    Value testVal(Word((int64_t)0), TAG_STRING);
+    assert (((uint8_t*)&testVal)[TAG_OFS] == TAG_STRING);
+
+    auto mem = mmap(
+        nullptr,
+        JIT_HEAP_INIT_SIZE,
+        PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0
+    );
 
-                // Push the return value on the stack
-                stack.push_back(retVal);
+    // Fall back to the interpreter if executable memory is unavailable
+    if (mem == MAP_FAILED)
+    {
+        useJit = false;
+        return;
+    }
 
-                // Jump to the return basic block
-                branchTo(retToBB);
-            }
-            break;
+    jitHeap = (uint8_t*)mem;
+    jitHeapLimit = jitHeap + JIT_HEAP_INIT_SIZE;
+    jitHeapAlloc = jitHeap;
+
+    // Save the callee-saved registers we use, keeping the
+    // stack aligned on 16 bytes, load the stack and frame
+    // registers, and jump to the code passed as argument
+    jitEnter = (void (*)(uint8_t*))jitHeapAlloc;
+    jitBytes({ 0x53, 0x41, 0x54, 0x41, 0x55 });
+    jitLoadStack(true);
+    jitBytes({ 0xFF, 0xE7 });
+
+    // Restore the registers and return to jitRun()
+    jitExitPtr = jitHeapAlloc;
+    jitBytes({ 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 });
+}
 
-            case RET:
-            {
-                auto val = stack.back();
-                stack.pop_back();
-                return val;
-            }
-            break;
+/// Run JIT-compiled code starting at a block version, until
+/// the current function returns to the host
+Value jitRun(BlockVersion* entryVer)
+{
+    jitEnter(getJitCode(entryVer));
 
-            case IMPORT:
-            {
-                auto pkgName = popStr();
-                auto pkg = import(pkgName);
-                stack.push_back(pkg);
-            }
-            break;
+    if (jitException)
+    {
+        auto exception = jitException;
+        jitException = nullptr;
+        std::rethrow_exception(exception);
+    }
 
-            case ABORT:
-            {
-                auto errMsg = (std::string)popStr();
+    return jitRetVal;
+}
 
-                // If a source position was specified
-                if (instr.hasField("src_pos"))
-                {
-                    auto srcPos = instr.getField("src_pos");
-                    std::cout << posToString(srcPos) << " - ";
-                }
+#endif
 
-                if (errMsg != "")
-                {
-                    std::cout << "aborting execution due to error: ";
-                    std::cout << errMsg << std::endl;
-                }
-                else
-                {
-                    std::cout << "aborting execution due to error" << std::endl;
-                }
+/**
+Begin the execution of a function from the host. The arguments must
+have been pushed on the stack. This returns when the callee returns.
+*/
+Value callFun(const FunInfo& info, size_t numArgs)
+{
+    // The host may be calling back into the interpreter while another
+    // function is executing. The state of the caller is restored if the
+    // callee throws, so that the failed call leaves no frame behind.
+    auto prevStackPtr = stackPtr + numArgs;
+    auto prevBasePtr = basePtr;
+    auto prevFramePtr = framePtr;
+    auto prevInstrPtr = instrPtr;
+
+    try
+    {
+        // A null return address makes execCode return to us
+        pushFrame(info, numArgs, nullptr);
 
-                exit(-1);
-            }
-            break;
+        Value retVal;
 
-            default:
-            assert (false && "unhandled op in interpreter");
+#ifdef HAVE_JIT
+        if (useJit)
+            retVal = jitRun(info.entryVer);
+        else
+#endif
+        {
+            // Begin execution at the entry block
+            instrPtr = getCodePtr(info.entryVer);
+            retVal = execCode();
         }
-    }
 
-    assert (false);
+        instrPtr = prevInstrPtr;
+
+        return retVal;
+    }
+    catch (...)
+    {
+        stackPtr = prevStackPtr;
+        basePtr = prevBasePtr;
+        framePtr = prevFramePtr;
+        instrPtr = prevInstrPtr;
+        throw;
+    }
 }
 
 /// Call a function exported by a package
@@ -963,385 +3661,518 @@ Value callExportFn(
     assert (fnVal.isObject());
     auto funObj = Object(fnVal);
 
-    return call(funObj, args);
-}
+    FunInfo funInfo;
+    getFunInfo(funObj, funInfo);
 
-Value testRunImage(std::string fileName)
-{
-    std::cout << "loading image \"" << fileName << "\"" << std::endl;
+    if (stackPtr - args.size() < stackLimit)
+    {
+        throw RunError("stack overflow");
+    }
 
-    auto pkg = parseFile(fileName);
+    // Push the arguments on the stack
+    for (auto arg : args)
+        pushVal(arg);
 
-    return callExportFn(pkg, "main");
+    return callFun(funInfo, args.size());
 }
 
-void testInterp()
+/// Print inline cache statistics
+void printICStats()
 {
-    std::cout << "interpreter tests" << std::endl;
+    auto printRate = [](std::string name, size_t hits, size_t misses)
+    {
+        auto total = hits + misses;
+        std::cout << "  " << name << ": " << hits << " hits, ";
+        std::cout << misses << " misses";
+        if (total > 0)
+            std::cout << " (" << (100.0 * hits / total) << "% hit rate)";
+        std::cout << std::endl;
+    };
 
-    assert (testRunImage("tests/zetavm/ex_ret_cst.zim") == Value(777));
-    assert (testRunImage("tests/zetavm/ex_loop_cnt.zim") == Value(0));
-    assert (testRunImage("tests/zetavm/ex_image.zim") == Value(10));
-    assert (testRunImage("tests/zetavm/ex_rec_fact.zim") == Value(5040));
-    assert (testRunImage("tests/zetavm/ex_fibonacci.zim") == Value(377));
+    std::cout << "inline cache stats" << std::endl;
+    printRate("field sites", fieldCacheHits, fieldCacheMisses);
+    std::cout << "  field caches: " << monoFieldSites << " monomorphic, ";
+    std::cout << polyFieldSites << " polymorphic, ";
+    std::cout << megaFieldSites << " megamorphic" << std::endl;
+    printRate("prop sites", propCacheHits, propCacheMisses);
+    printRate("call sites", callCacheHits, callCacheMisses);
+    std::cout << "  named field lookups: " << namedLookupCount << std::endl;
 }
 
-//============================================================================
-// New interpreter
-//============================================================================
-
-/// Initial code heap size in bytes
-const size_t CODE_HEAP_INIT_SIZE = 1 << 20;
-
-/// Initial stack size in words
-const size_t STACK_INIT_SIZE = 1 << 16;
-
-class CodeFragment
+void printVersionStats()
 {
-public:
+    // Histogram of compiled versions per block
+    std::vector<size_t> numBlocks;
+    size_t numVersions = 0;
+    size_t numStubs = 0;
 
-    /// Start index in the executable heap
-    uint8_t* startPtr = nullptr;
+    for (auto& pair : versionMap)
+    {
+        size_t numCompiled = 0;
+        for (auto version : pair.second)
+        {
+            if (version->startPtr)
+                numCompiled++;
+            else
+                numStubs++;
+        }
 
-    /// End index in the executable heap
-    uint8_t* endPtr = nullptr;
+        if (numCompiled == 0)
+            continue;
 
-    /// Get the length of the code fragment
-    size_t length()
-    {
-        assert (startPtr);
-        assert (endPtr);
-        return endPtr - startPtr;
+        if (numBlocks.size() <= numCompiled)
+            numBlocks.resize(numCompiled + 1, 0);
+        numBlocks[numCompiled]++;
+        numVersions += numCompiled;
     }
 
-    /*
-    /// Store the start position of the code
-    void markStart(CodeBlock as)
-    {
-        assert (
-            startIdx is startIdx.max,
-            "start position is already marked"
-        );
-
-        startIdx = cast(uint32_t)as.getWritePos();
+    size_t totalBlocks = 0;
+    for (auto count : numBlocks)
+        totalBlocks += count;
 
-        // Add a label string comment
-        if (opts.genasm)
-            as.writeString(this.getName ~ ":");
-    }
-    */
+    std::cout << "block version stats" << std::endl;
+    std::cout << "  blocks compiled: " << totalBlocks << std::endl;
+    std::cout << "  versions compiled: " << numVersions;
+    std::cout << " (max " << maxVersions << " per block)" << std::endl;
+    std::cout << "  versions never compiled: " << numStubs << std::endl;
 
-    /*
-    /// Store the end position of the code
-    void markEnd(CodeBlock as)
+    for (size_t i = 1; i < numBlocks.size(); ++i)
     {
-        assert (
-            !ended,
-            "end position is already marked"
-        );
-
-        endIdx = cast(uint32_t)as.getWritePos();
+        if (numBlocks[i] == 0)
+            continue;
+        std::cout << "  blocks with " << i << " version(s): ";
+        std::cout << numBlocks[i] << std::endl;
     }
-    */
-};
-
-class BlockVersion : public CodeFragment
-{
-public:
-
-    /// Associated block
-    Object block;
-
-    /// Code generation context at block entry
-    //CodeGenCtx ctx;
 
-    BlockVersion(Object block)
-    : block(block)
+    size_t numJitVersions = 0;
+    size_t jitCodeSize = 0;
+    for (auto& pair : versionMap)
     {
+        for (auto version : pair.second)
+        {
+            if (version->jitCode.startPtr)
+            {
+                numJitVersions++;
+                jitCodeSize += version->jitCode.length();
+            }
+        }
     }
-};
-
-typedef std::vector<BlockVersion*> VersionList;
 
-/// Flat array of bytes into which code gets compiled
-uint8_t* codeHeap = nullptr;
+    std::cout << "  versions compiled to machine code: " << numJitVersions;
+    std::cout << " (" << jitCodeSize << " bytes)" << std::endl;
 
-/// Limit pointer for the code heap
-uint8_t* codeHeapLimit = nullptr;
+    std::cout << "  type tests resolved at compile time: ";
+    std::cout << staticTagTests << std::endl;
+    std::cout << "  type tests left to run time: ";
+    std::cout << dynamicTagTests << std::endl;
+}
 
-/// Current allocation pointer in the code heap
-uint8_t* codeHeapAlloc = nullptr;
+/// Profile entry, an opcode sequence or source position with its count
+struct ProfileEntry
+{
+    std::vector<Opcode> ops;
+    std::string srcPos;
+    size_t count;
+};
 
-/// Map of block objects to lists of versions
-std::unordered_map<refptr, VersionList> versionMap;
+typedef std::vector<ProfileEntry> ProfileTable;
 
-/// Size of the stack in words
-size_t stackSize = 0;
+/// Collect the nonzero counts of opcode sequences of a given length,
+/// sorted by decreasing count
+ProfileTable sortSeqCounts(const std::vector<size_t>& counts, size_t seqLen)
+{
+    ProfileTable table;
 
-/// Lower stack limit (stack pointer must be greater than this)
-Value* stackLimit = nullptr;
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        if (counts[i] == 0)
+            continue;
 
-/// Stack bottom (end of the stack memory array)
-Value* stackBottom = nullptr;
+        ProfileEntry entry;
+        entry.count = counts[i];
 
-/// Stack frame base pointer
-Value* basePtr = nullptr;
+        // Decode the opcodes from the table index
+        entry.ops.resize(seqLen);
+        auto idx = i;
+        for (size_t j = seqLen; j > 0; --j)
+        {
+            entry.ops[j-1] = (Opcode)(idx % NUM_OPCODES);
+            idx /= NUM_OPCODES;
+        }
 
-/// Current temp stack top pointer
-Value* stackPtr = nullptr;
+        table.push_back(entry);
+    }
 
-// Current instruction pointer
-uint8_t* instrPtr = nullptr;
+    std::stable_sort(
+        table.begin(),
+        table.end(),
+        [](const ProfileEntry& a, const ProfileEntry& b)
+        {
+            return a.count > b.count;
+        }
+    );
 
-// Write a value to the code heap
-template <typename T> void writeVal(T val)
-{
-    assert (codeHeapAlloc < codeHeapLimit);
-    T* heapPtr = (T*)codeHeapAlloc;
-    *heapPtr = val;
-    codeHeapAlloc += sizeof(T);
-    assert (codeHeapAlloc <= codeHeapLimit);
+    return table;
 }
 
-template <typename T> T readVal()
+/// Collect the execution counts per source position, sorted by
+/// decreasing count
+ProfileTable sortPosCounts()
 {
-    assert (instrPtr + sizeof(T) <= codeHeapLimit);
-    T* valPtr = (T*)instrPtr;
-    auto val = *valPtr;
-    instrPtr += sizeof(T);
-    return val;
-}
+    std::unordered_map<std::string, size_t> posCounts;
+    for (auto site : profileSites)
+    {
+        if (site->srcPos.isValid() && site->count > 0)
+            posCounts[posToString(site->srcPos)] += site->count;
+    }
 
-/// Initialize the interpreter
-void initInterp()
-{
-    // Allocate the code heap
-    codeHeap = new uint8_t[CODE_HEAP_INIT_SIZE];
-    codeHeapLimit = codeHeap + CODE_HEAP_INIT_SIZE;
-    codeHeapAlloc = codeHeap;
+    ProfileTable table;
+    for (auto& pair : posCounts)
+    {
+        ProfileEntry entry;
+        entry.srcPos = pair.first;
+        entry.count = pair.second;
+        table.push_back(entry);
+    }
 
-    // Allocate the stack
-    stackSize = STACK_INIT_SIZE;
-    stackLimit = new Value[STACK_INIT_SIZE];
-    stackBottom = stackLimit + sizeof(Word);
-    stackPtr = stackBottom;
+    std::sort(
+        table.begin(),
+        table.end(),
+        [](const ProfileEntry& a, const ProfileEntry& b)
+        {
+            if (a.count != b.count)
+                return a.count > b.count;
+            return a.srcPos < b.srcPos;
+        }
+    );
+
+    return table;
 }
 
-// TODO: do we already need a versioning context?
-// we need to manage the temp stack size?
-// can technically just use the stack top for this?
+/// Maximum number of entries listed in each table of the text report
+const size_t PROFILE_REPORT_LINES = 40;
 
-/// Get a version of a block. This version will be a stub
-/// until compiled
-BlockVersion* getBlockVersion(Object block)
+void printOpProfile()
 {
-    auto blockPtr = (refptr)block;
-
-    auto versionItr = versionMap.find((refptr)block);
+    size_t total = 0;
+    for (auto count : opCounts)
+        total += count;
 
-    if (versionItr == versionMap.end())
+    auto printTable = [total](std::string title, const ProfileTable& table)
     {
-        versionMap[blockPtr] = VersionList();
-    }
-    else
-    {
-        auto versions = versionItr->second;
-        assert (versions.size() == 1);
-        return versions[0];
-    }
+        std::cout << title << std::endl;
 
-    auto newVersion = new BlockVersion(block);
+        for (size_t i = 0; i < table.size() && i < PROFILE_REPORT_LINES; ++i)
+        {
+            auto& entry = table[i];
+            printf("  %12zu  %5.1f%%  ", entry.count, 100.0 * entry.count / total);
+
+            if (entry.ops.size() > 0)
+            {
+                for (size_t j = 0; j < entry.ops.size(); ++j)
+                    std::cout << (j > 0? "; ":"") << opToStr(entry.ops[j]);
+            }
+            else
+            {
+                std::cout << entry.srcPos;
+            }
 
-    auto& versionList = versionMap[blockPtr];
-    versionList.push_back(newVersion);
+            std::cout << std::endl;
+        }
+    };
 
-    return newVersion;
+    std::cout << "op profile, " << total << " instructions executed" << std::endl;
+    printTable("opcodes:", sortSeqCounts(opCounts, 1));
+    printTable("opcode pairs:", sortSeqCounts(pairCounts, 2));
+    printTable("opcode trigrams:", sortSeqCounts(trigramCounts, 3));
+    printTable("call and abort sites:", sortPosCounts());
 }
 
-void compile(BlockVersion* version)
+/// Quote a string for JSON output
+std::string jsonStr(std::string str)
 {
-    auto block = version->block;
+    std::string out = "\"";
 
-    // Block name icache, for debugging
-    static ICache nameIC("name");
-    auto name = nameIC.getStr(block);
+    for (auto ch : str)
+    {
+        if (ch == '"' || ch == '\\')
+            out += '\\';
+        out += ch;
+    }
 
-    // Get the instructions array
-    static ICache instrsIC("instrs");
-    Array instrs = instrsIC.getArr(block);
+    return out + "\"";
+}
 
-    // Mark the block start
-    version->startPtr = codeHeapAlloc;
+void writeOpProfileJson(std::string fileName)
+{
+    auto file = fopen(fileName.c_str(), "w");
+    if (!file)
+    {
+        std::cout << "could not write \"" << fileName << "\"" << std::endl;
+        return;
+    }
 
-    // For each instruction
-    for (size_t i = 0; i < instrs.length(); ++i)
+    auto writeTable = [file](std::string name, const ProfileTable& table, bool last)
     {
-        auto instrVal = instrs.getElem(i);
-        assert (instrVal.isObject());
-        auto instr = (Object)instrVal;
+        fprintf(file, "  %s: [\n", jsonStr(name).c_str());
 
-        static ICache opIC("op");
-        auto op = (std::string)opIC.getStr(instr);
+        for (size_t i = 0; i < table.size(); ++i)
+        {
+            auto& entry = table[i];
 
-        std::cout << "op: " << op << std::endl;
+            if (entry.ops.size() > 0)
+            {
+                fprintf(file, "    { \"ops\": [");
+                for (size_t j = 0; j < entry.ops.size(); ++j)
+                    fprintf(file, "%s%s", j > 0? ", ":"", jsonStr(opToStr(entry.ops[j])).c_str());
+                fprintf(file, "], ");
+            }
+            else
+            {
+                fprintf(file, "    { \"src_pos\": %s, ", jsonStr(entry.srcPos).c_str());
+            }
 
-        if (op == "push")
-        {
-            static ICache valIC("val");
-            auto val = valIC.getField(instr);
-            writeVal(PUSH);
-            writeVal(val);
-            continue;
+            fprintf(file, "\"count\": %zu }%s\n", entry.count, (i + 1 < table.size())? ",":"");
         }
 
-        if (op == "ret")
-        {
-            writeVal(RET);
-            continue;
-        }
+        fprintf(file, "  ]%s\n", last? "":",");
+    };
 
-        throw RunError("unhandled opcode in basic block \"" + op + "\"");
-    }
+    size_t total = 0;
+    for (auto count : opCounts)
+        total += count;
 
-    // Mark the block end
-    version->endPtr = codeHeapAlloc;
-}
+    fprintf(file, "{\n");
+    fprintf(file, "  \"total\": %zu,\n", total);
+    writeTable("ops", sortSeqCounts(opCounts, 1), false);
+    writeTable("pairs", sortSeqCounts(pairCounts, 2), false);
+    writeTable("trigrams", sortSeqCounts(trigramCounts, 3), false);
+    writeTable("src_pos", sortPosCounts(), true);
+    fprintf(file, "}\n");
 
-/// Push a value on the stack
-void pushVal(Value val)
-{
-    stackPtr--;
-    stackPtr[0] = val;
+    fclose(file);
 }
 
-/// Start/continue execution beginning at a current instruction
-Value execCode()
+/// Allocation samples attributed to a site
+struct AllocSite
 {
-    assert (instrPtr >= codeHeap);
-    assert (instrPtr < codeHeapLimit);
+    size_t numSamples = 0;
+    size_t numBytes = 0;
+};
 
-    // For each instruction to execute
-    for (;;)
-    {
-        auto op = readVal<Opcode>();
+/// Allocation samples per site label. Versions of the same block
+/// have distinct copies of an instruction, which share a label.
+std::unordered_map<std::string, AllocSite> allocSites;
 
-        switch (op)
-        {
-            case PUSH:
-            {
-                auto val = readVal<Value>();
+/// Site labels per instruction address. Allocations made by
+/// the host outside of any instruction are under the null address.
+std::unordered_map<uint8_t*, std::string> instrLabels;
 
-                // TODO
-            }
-            break;
+/// Sampled bytes per call stack, in folded stack format
+std::unordered_map<std::string, size_t> allocStacks;
 
-            // TODO: stop when returning to null
-            case RET:
-            {
-                // Pop val from stack
+/// Number of bytes allocated between samples
+size_t allocSampleBytes = 0;
 
+/// Find the instruction executing, which ends at the instruction
+/// pointer, and the block version it belongs to
+uint8_t* findCurInstr(BlockVersion*& version)
+{
+    version = nullptr;
 
+    if (!instrPtr)
+        return nullptr;
 
-            }
-            break;
+    auto itr = versionsByAddr.upper_bound(instrPtr - 1);
+    if (itr == versionsByAddr.begin())
+        return nullptr;
+    --itr;
 
-            default:
-            assert (false);
-        }
+    if (instrPtr > itr->second->endPtr)
+        return nullptr;
+    version = itr->second;
+
+    for (auto codePtr = version->startPtr; codePtr < version->endPtr;)
+    {
+        auto startPtr = codePtr;
+        auto op = decodeOp(readCode<OpField>(codePtr));
+        codePtr += operandSize(op);
 
+        if (codePtr >= instrPtr)
+            return startPtr;
     }
 
-    assert (false);
+    return nullptr;
 }
 
-/// Begin the execution of a function (top-level call)
-Value callFun(Object fun, ValueVec args)
+/// Attribute an allocation sample to the executing instruction
+/// and to the call stack
+void sampleAlloc(size_t bytes)
 {
-    static ICache numParamsIC("num_params");
-    static ICache numLocalsIC("num_locals");
-    auto numParams = numParamsIC.getInt64(fun);
-    auto numLocals = numLocalsIC.getInt64(fun);
-    assert (args.size() <= numParams);
-    assert (numParams <= numLocals);
-
-    std::cout << "pushing RA" << std::endl;
+    BlockVersion* version;
+    auto instr = findCurInstr(version);
 
-    // Push the caller function and return address
-    // Note: these are placeholders because we are doing a toplevel call
-    assert (stackPtr == stackBottom);
-    pushVal(Value(0));
-    pushVal(Value(nullptr, TAG_RETADDR));
+    auto& label = instrLabels[instr];
 
-    // Initialize the base pointer (used to access locals)
-    basePtr = stackPtr - 1;
-
-    // Push space for the local variables
-    stackPtr -= numLocals;
-    assert (stackPtr >= stackLimit);
+    if (label == "")
+    {
+        if (instr)
+        {
+            auto operands = instr;
+            auto op = decodeOp(readCode<OpField>(operands));
+            auto srcPos = getInstrSrcPos(op, operands);
+            label = opToStr(op) + (srcPos.isValid()?
+                " @ " + posToString(srcPos):
+                " in " + blockLabel(version)
+            );
+        }
+        else
+        {
+            label = "host";
+        }
+    }
 
-    std::cout << "pushing locals" << std::endl;
+    auto& site = allocSites[label];
+    site.numSamples++;
+    site.numBytes += bytes;
 
-    // Copy the arguments into the locals
-    for (size_t i = 0; i < args.size(); ++i)
+    // Collect the call sites of the active frames, innermost first.
+    // Frames called from the host have no call site.
+    std::vector<const std::string*> frames;
+    for (auto frame = framePtr; frame; frame = (Value*)frame[-2].getWord().ptr)
     {
-        //std::cout << "  " << args[i].toString() << std::endl;
-        basePtr[i] = args[i];
+        auto retVer = (BlockVersion*)frame[0].getWord().ptr;
+        if (!retVer)
+            continue;
+
+        auto itr = callSiteLabels.find(retVer);
+        if (itr != callSiteLabels.end())
+            frames.push_back(&itr->second);
     }
 
-    // Get the function entry block
-    static ICache entryIC("entry");
-    auto entryBlock = entryIC.getObj(fun);
+    std::string stack;
+    for (auto itr = frames.rbegin(); itr != frames.rend(); ++itr)
+        stack += **itr + ";";
+    stack += label;
+
+    allocStacks[stack] += bytes;
+}
+
+void startAllocProfiling(size_t sampleBytes)
+{
+    allocProfiling = true;
+    allocSampleBytes = sampleBytes;
+    onGlobalDef = nameBlock;
+    vm.setAllocSampling(sampleBytes, sampleAlloc);
+}
 
-    auto entryVer = getBlockVersion(entryBlock);
+void printAllocProfile()
+{
+    std::vector<std::pair<std::string, AllocSite>> sites(
+        allocSites.begin(),
+        allocSites.end()
+    );
+    size_t numSamples = 0;
+    size_t numBytes = 0;
 
-    // Generate code for the entry block version
-    compile(entryVer);
-    assert (entryVer->length() > 0);
+    for (auto& pair : sites)
+    {
+        numSamples += pair.second.numSamples;
+        numBytes += pair.second.numBytes;
+    }
 
-    // Begin execution at the entry block
-    //auto retVal = execCode(entryVer->startPtr);
+    std::sort(
+        sites.begin(),
+        sites.end(),
+        [](const std::pair<std::string, AllocSite>& a,
+           const std::pair<std::string, AllocSite>& b)
+        {
+            if (a.second.numBytes != b.second.numBytes)
+                return a.second.numBytes > b.second.numBytes;
+            return a.first < b.first;
+        }
+    );
 
-    // Pop the local variables, return address and calling function
-    stackPtr += numLocals;
-    stackPtr += 2;
-    assert (stackPtr == stackBottom);
+    std::cout << "allocation profile, " << numSamples << " samples, ";
+    std::cout << numBytes << " bytes, sampled about every ";
+    std::cout << allocSampleBytes << " bytes" << std::endl;
 
-    // TODO
-    //return retVal;
-    return Value(777);
+    for (size_t i = 0; i < sites.size() && i < PROFILE_REPORT_LINES; ++i)
+    {
+        auto& site = sites[i].second;
+        printf(
+            "  %12zu  %5.1f%%  %8zu  ",
+            site.numBytes,
+            100.0 * site.numBytes / numBytes,
+            site.numSamples
+        );
+        std::cout << sites[i].first << std::endl;
+    }
 }
 
-/// Call a function exported by a package
-Value callExportFnNew(
-    Object pkg,
-    std::string fnName,
-    ValueVec args = ValueVec()
-)
+void writeAllocProfileFolded(std::string fileName)
 {
-    assert (pkg.hasField(fnName));
-    auto fnVal = pkg.getField(fnName);
-    assert (fnVal.isObject());
-    auto funObj = Object(fnVal);
+    auto file = fopen(fileName.c_str(), "w");
+    if (!file)
+    {
+        std::cout << "could not write \"" << fileName << "\"" << std::endl;
+        return;
+    }
+
+    // Sort the stacks so that the output is deterministic
+    std::vector<std::pair<std::string, size_t>> stacks(
+        allocStacks.begin(),
+        allocStacks.end()
+    );
+    std::sort(stacks.begin(), stacks.end());
 
-    return callFun(funObj, args);
+    for (auto& pair : stacks)
+        fprintf(file, "%s %zu\n", pair.first.c_str(), pair.second);
+
+    fclose(file);
 }
 
-Value testRunImageNew(std::string fileName)
+Value testRunImage(std::string fileName)
 {
     std::cout << "loading image \"" << fileName << "\"" << std::endl;
 
     auto pkg = parseFile(fileName);
 
-    return callExportFnNew(pkg, "main");
+    return callExportFn(pkg, "main");
 }
 
-void testInterpNew()
+void testInterp()
 {
-    // TODO: call main function of simple test
+    std::cout << "interpreter tests" << std::endl;
+
+    // Run the tests with and without the JIT, when available
+    auto jitAvail = useJit;
+    for (int i = 0; i < 2; ++i)
+    {
+        useJit = jitAvail && (i == 0);
+
+        assert (testRunImage("tests/zetavm/ex_ret_cst.zim") == Value(777));
+        assert (testRunImage("tests/zetavm/ex_loop_cnt.zim") == Value(0));
+        assert (testRunImage("tests/zetavm/ex_image.zim") == Value(10));
+        assert (testRunImage("tests/zetavm/ex_rec_fact.zim") == Value(5040));
+        assert (testRunImage("tests/zetavm/ex_fibonacci.zim") == Value(377));
+
+        // Constant branch conditions must still be type checked,
+        // and the failed call must not leave its frame on the stack
+        bool caught = false;
+        auto prevStackPtr = stackPtr;
+        auto prevFramePtr = framePtr;
+        try
+        {
+            testRunImage("tests/zetavm/ex_if_non_bool.zim");
+        }
+        catch (RunError& e)
+        {
+            caught = true;
+        }
+        assert (caught);
+        assert (stackPtr == prevStackPtr && framePtr == prevFramePtr);
+    }
 
-    assert (testRunImageNew("tests/zetavm/ex_ret_cst.zim") == Value(777));
-    //assert (testRunImageNew("tests/zetavm/ex_loop_cnt.zim") == Value(0));
-    //assert (testRunImageNew("tests/zetavm/ex_image.zim") == Value(10));
-    //assert (testRunImageNew("tests/zetavm/ex_rec_fact.zim") == Value(5040));
-    //assert (testRunImageNew("tests/zetavm/ex_fibonacci.zim") == Value(377));
+    useJit = jitAvail;
 }
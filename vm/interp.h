@@ -15,5 +15,40 @@ Value callExportFn(
     ValueVec args = ValueVec()
 );
 
+/// Maximum number of versions generated for each block
+extern size_t maxVersions;
+
+/// Run code through the JIT compiler, when available
+extern bool useJit;
+
+/// Fuse instruction sequences into superinstructions
+extern bool useFusion;
+
+/// Count instruction executions
+extern bool opProfiling;
+
+/// Print inline cache statistics
+void printICStats();
+
+/// Print block version statistics
+void printVersionStats();
+
+/// Print the instruction execution profile
+void printOpProfile();
+
+/// Write the instruction execution profile as JSON
+void writeOpProfileJson(std::string fileName);
+
+/// Sample allocations, about every sampleBytes bytes allocated, and
+/// attribute them to instructions. Must be called before any code is
+/// loaded, so that block names can be recorded.
+void startAllocProfiling(size_t sampleBytes);
+
+/// Print the allocation sites profile, by decreasing bytes sampled
+void printAllocProfile();
+
+/// Write the allocation profile as folded call stacks,
+/// the input format of flame graph tools
+void writeAllocProfileFolded(std::string fileName);
+
 void testInterp();
-void testInterpNew();
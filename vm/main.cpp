@@ -1,11 +1,57 @@
 #include <cassert>
 #include <cstring>
+#include <cstdlib>
 #include <iostream>
 #include <exception>
 #include "parser.h"
 #include "interp.h"
 #include "core.h"
 
+/// Output file for the JSON instruction profile
+std::string opProfileJsonFile;
+
+void writeOpProfile()
+{
+    writeOpProfileJson(opProfileJsonFile);
+}
+
+/// Output file for the folded allocation stacks
+std::string allocProfileFoldedFile;
+
+void writeAllocProfile()
+{
+    writeAllocProfileFolded(allocProfileFoldedFile);
+}
+
+/// Print the command-line options
+void printUsage()
+{
+    std::cout <<
+        "usage: zeta [options] <file>\n"
+        "\n"
+        "  --no-jit                     run in the interpreter only\n"
+        "  --no-fusion                  do not fuse instruction sequences\n"
+        "  --max-versions N             limit the versions per block\n"
+        "  --ic-stats                   print inline cache statistics\n"
+        "  --version-stats              print block versioning statistics\n"
+        "  --gc-stress                  collect at every safepoint\n"
+        "  --gc-stats                   print collection pause statistics\n"
+        "  --heap-stats                 print heap allocation statistics\n"
+        "  --op-profile                 print instruction execution counts.\n"
+        "                               Implies --no-jit and --no-fusion, so\n"
+        "                               that the opcode pairs and trigrams are\n"
+        "                               the unfused sequences in the images\n"
+        "  --op-profile-json FILE       write the instruction profile as JSON,\n"
+        "                               with the same implied options\n"
+        "  --alloc-profile              print the top allocation sites\n"
+        "  --alloc-profile-folded FILE  write allocation call stacks in the\n"
+        "                               folded format of flame graph tools\n"
+        "  --alloc-sample-bytes N       bytes between allocation samples,\n"
+        "                               on average (default 65536)\n"
+        "  --test                       run the unit tests\n"
+        "  --help                       print this message\n";
+}
+
 int main(int argc, char** argv)
 {
     try
@@ -20,25 +66,139 @@ int main(int argc, char** argv)
             testRuntime();
             testParser();
             testInterp();
-            testInterpNew();
             return 0;
         }
 
-        if (argc == 2)
+        // Parse the command-line options
+        std::string fileName;
+        bool allocProfiling = false;
+        size_t allocSampleBytes = 65536;
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+
+            if (arg == "--help")
+            {
+                printUsage();
+                return 0;
+            }
+            else if (arg == "--ic-stats")
+            {
+                atexit(printICStats);
+            }
+            else if (arg == "--no-jit")
+            {
+                useJit = false;
+            }
+            else if (arg == "--no-fusion")
+            {
+                useFusion = false;
+            }
+            else if (arg == "--gc-stress")
+            {
+                vm.setStressMode(true);
+            }
+            else if (arg == "--gc-stats")
+            {
+                atexit([]() { vm.printGCStats(); });
+            }
+            else if (arg == "--heap-stats")
+            {
+                atexit([]() { vm.printHeapStats(); });
+            }
+            else if (arg == "--version-stats")
+            {
+                atexit(printVersionStats);
+            }
+            else if (arg == "--op-profile")
+            {
+                // The JIT has no profiling hooks, profile in the interpreter.
+                // Fusion would hide the raw sequences the profile is for.
+                opProfiling = true;
+                useJit = false;
+                useFusion = false;
+                atexit(printOpProfile);
+            }
+            else if (arg == "--op-profile-json" && i + 1 < argc)
+            {
+                opProfiling = true;
+                useJit = false;
+                useFusion = false;
+                opProfileJsonFile = argv[++i];
+                atexit(writeOpProfile);
+            }
+            else if (arg == "--alloc-profile")
+            {
+                allocProfiling = true;
+                atexit(printAllocProfile);
+            }
+            else if (arg == "--alloc-profile-folded" && i + 1 < argc)
+            {
+                allocProfiling = true;
+                allocProfileFoldedFile = argv[++i];
+                atexit(writeAllocProfile);
+            }
+            else if (arg == "--alloc-sample-bytes" && i + 1 < argc)
+            {
+                auto sampleBytes = atoll(argv[++i]);
+
+                if (sampleBytes < 1)
+                {
+                    std::cout << "--alloc-sample-bytes must be at least 1" << std::endl;
+                    return -1;
+                }
+
+                allocSampleBytes = sampleBytes;
+            }
+            else if (arg == "--max-versions" && i + 1 < argc)
+            {
+                auto maxVal = atoi(argv[++i]);
+
+                if (maxVal < 1)
+                {
+                    std::cout << "--max-versions must be at least 1" << std::endl;
+                    return -1;
+                }
+
+                maxVersions = maxVal;
+            }
+            else if (arg.length() > 0 && arg[0] == '-')
+            {
+                std::cout << "Unknown option \"" << arg << "\"" << std::endl;
+                return -1;
+            }
+            else if (fileName == "")
+            {
+                fileName = arg;
+            }
+            else
+            {
+                fileName = "";
+                break;
+            }
+        }
+
+        // Block names are recorded as images are parsed
+        if (allocProfiling)
+        {
+            startAllocProfiling(allocSampleBytes);
+        }
+
+        if (fileName != "")
         {
-            auto fileName = argv[1];
-            auto pkg = load(fileName);
+            // The package may move while its functions run
+            HostRoot pkg(load(fileName));
 
             // Initialize the package
-            if (pkg.hasField("init"))
+            if (Object(pkg.get()).hasField("init"))
             {
-                callExportFn(pkg, "init");
+                callExportFn(pkg.get(), "init");
             }
 
             // Call the main function, if present
-            if (pkg.hasField("main"))
+            if (Object(pkg.get()).hasField("main"))
             {
-                auto retVal = callExportFn(pkg, "main");
+                auto retVal = callExportFn(pkg.get(), "main");
                 return (int64_t)retVal;
             }
 
@@ -444,8 +444,8 @@ Parse an object literal
 */
 Value parseObject(Input& input)
 {
-    // Allocate an empty object
-    Object obj = Object::newObject();
+    // Parse the fields first, to allocate the object at the exact size
+    std::vector<std::pair<std::string, Value>> fields;
 
     // Until the end of the list
     for (;;)
@@ -468,10 +468,7 @@ Value parseObject(Input& input)
         // Parse an expression
         auto expr = parseExpr(input);
 
-        // Set the property on the object
-        obj.setField(ident, expr);
-
-        assert (obj.hasField(ident));
+        fields.push_back(std::make_pair(ident, expr));
 
         // If this is the end of the list
         input.eatWS();
@@ -484,6 +481,14 @@ Value parseObject(Input& input)
         input.expect(",");
     }
 
+    Object obj = Object::newObject(fields.size());
+
+    for (auto& field : fields)
+    {
+        obj.setField(field.first, field.second);
+        assert (obj.hasField(field.first));
+    }
+
     return obj;
 }
 
@@ -715,6 +720,8 @@ Value resolveRefs(
     return exportsTree;
 }
 
+GlobalDefFn onGlobalDef = nullptr;
+
 Value parseInput(Input& input)
 {
     // Global definitions
@@ -781,6 +788,12 @@ Value parseInput(Input& input)
     // Resolve the global references in the image
     exports = resolveRefs(globalDefs, exports);
 
+    if (onGlobalDef)
+    {
+        for (auto& def : globalDefs)
+            onGlobalDef(input.getSrcName(), def.first, def.second);
+    }
+
     // Return the last evaluated value
     return exports;
 }
@@ -104,6 +104,17 @@ public:
     }
 };
 
+/// Function called with the source name, name and value of each
+/// global definition, once an image has been parsed
+typedef void (*GlobalDefFn)(
+    const std::string& srcName,
+    const std::string& name,
+    Value val
+);
+
+/// Global definition callback, null if none
+extern GlobalDefFn onGlobalDef;
+
 // Parse the optional language directive at the beginning of a file
 std::string parseLang(Input& input);
 
@@ -1,4 +1,7 @@
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
@@ -19,11 +22,18 @@ const Value Value::TWO(2l);
 // Global virtual machine instance
 VM vm;
 
-Value::Value(Word w, Tag t)
-{
-    word = w;
-    tag = t;
-}
+// Field cache hit/miss counts for field accesses
+size_t fieldCacheHits = 0;
+size_t fieldCacheMisses = 0;
+
+// Property cache hit/miss counts for property reads
+size_t propCacheHits = 0;
+size_t propCacheMisses = 0;
+
+// Number of monomorphic, polymorphic and megamorphic field caches
+size_t monoFieldSites = 0;
+size_t polyFieldSites = 0;
+size_t megaFieldSites = 0;
 
 /// Produce a string representation of a value
 std::string Value::toString() const
@@ -70,18 +80,6 @@ bool Value::isPointer() const
     }
 }
 
-Value::operator bool () const
-{
-    assert (tag == TAG_BOOL);
-    return word.int64? 1:0;
-}
-
-Value::operator int64_t () const
-{
-    assert (tag == TAG_INT64);
-    return word.int64;
-}
-
 Value::operator refptr () const
 {
     assert (isPointer());
@@ -94,8 +92,154 @@ Value::operator std::string () const
     return String(*this);
 }
 
+/// Minor collection pause histogram bucket bounds, in milliseconds
+const double VM::PAUSE_BUCKETS[VM::NUM_PAUSE_BUCKETS] = {
+    0.05, 0.1, 0.25, 0.5, 1, 2, 5, 10, 20, 50
+};
+
 VM::VM()
 {
+    for (auto& freeList : freeLists)
+        freeList = nullptr;
+
+    nurseryStart = (uint8_t*)calloc(1, NURSERY_SIZE);
+    nurseryPtr = nurseryStart;
+    nurseryLimit = nurseryStart + NURSERY_SIZE;
+}
+
+/// Round a block size up to a whole number of words
+static size_t roundSize(size_t size)
+{
+    return (size + sizeof(Word) - 1) & ~(sizeof(Word) - 1);
+}
+
+void VM::Space::release()
+{
+    for (auto chunk : chunks)
+        free(chunk);
+
+    for (auto block : largeBlocks)
+        free(block);
+
+    chunks.clear();
+    largeBlocks.clear();
+    allocPtr = nullptr;
+    allocLimit = nullptr;
+    size = 0;
+}
+
+uint8_t* VM::allocBlock(Space& space, size_t size)
+{
+    size = roundSize(size);
+    bytesAllocated += size;
+    space.size += size;
+
+    if (&space == &heap && heap.size + internedSize >= gcLimit)
+        gcPending = true;
+
+    // Reuse a freed heap block of the same size if there is one
+    auto numWords = size / sizeof(Word);
+    if (&space == &heap && numWords <= MAX_SMALL_WORDS && freeLists[numWords])
+    {
+        auto ptr = freeLists[numWords];
+        freeLists[numWords] = *(uint8_t**)ptr;
+        memset(ptr, 0, size);
+        return ptr;
+    }
+
+    // Large blocks get their own allocation
+    if (size > MAX_CHUNK_ALLOC)
+    {
+        auto ptr = (uint8_t*)calloc(1, size);
+        space.largeBlocks.insert(ptr);
+        return ptr;
+    }
+
+    // Start a new chunk when the current one is full. Chunks
+    // come zeroed, so bump-allocated blocks need no clearing.
+    if (space.allocPtr + size > space.allocLimit)
+    {
+        auto chunk = (uint8_t*)calloc(1, CHUNK_SIZE);
+        space.chunks.push_back(chunk);
+        space.allocPtr = chunk;
+        space.allocLimit = chunk + CHUNK_SIZE;
+    }
+
+    auto ptr = space.allocPtr;
+    space.allocPtr += size;
+    return ptr;
+}
+
+uint8_t* VM::allocYoung(size_t size)
+{
+    size = roundSize(size);
+
+    // The nursery is cleared when it gets emptied,
+    // so blocks allocated in it are already zeroed
+    if (nurseryPtr + size <= nurseryLimit)
+    {
+        auto ptr = nurseryPtr;
+        nurseryPtr += size;
+        bytesAllocated += size;
+        return ptr;
+    }
+
+    // Collect the nursery at the next safepoint, and allocate
+    // in the old space until then
+    if (size <= MAX_NURSERY_ALLOC)
+        gcPending = true;
+
+    return allocBlock(heap, size);
+}
+
+void VM::countAlloc(size_t size, Tag tag)
+{
+    assert (tag < sizeof(tagStats) / sizeof(tagStats[0]));
+    tagStats[tag].count++;
+    tagStats[tag].bytes += size;
+
+    // Sizes are whole words, so (size - 1) >> 4 is zero for the first
+    // bucket, and has one more significant bit for each next bucket
+    size_t bucket = 0;
+    if (auto bits = (size - 1) >> 4)
+        bucket = std::min(
+            64 - __builtin_clzll(bits),
+            (int)NUM_SIZE_BUCKETS - 1
+        );
+    sizeStats[bucket].count++;
+    sizeStats[bucket].bytes += size;
+
+    countSample(size);
+}
+
+void VM::takeSample()
+{
+    auto bytes = (size_t)(sampleLength - sampleCountdown);
+    sampleLength = nextSampleLength();
+    sampleCountdown = sampleLength;
+    sampleFn(bytes);
+}
+
+int64_t VM::nextSampleLength()
+{
+    // Exponentially distributed lengths make sampling a Poisson
+    // process, which fixed intervals could alias with
+    sampleRandState ^= sampleRandState << 13;
+    sampleRandState ^= sampleRandState >> 7;
+    sampleRandState ^= sampleRandState << 17;
+    auto u = ((sampleRandState >> 11) + 1) * (1.0 / 9007199254740992.0);
+    auto length = -std::log(u) * sampleInterval;
+
+    return (int64_t)std::min(std::max(length, 1.0), (double)INT64_MAX / 2);
+}
+
+void VM::setAllocSampling(size_t interval, AllocSampleFn fn)
+{
+    assert (interval > 0);
+    sampleFn = fn;
+    sampleInterval = interval;
+    sampleLength = nextSampleLength();
+    sampleCountdown = sampleLength;
 }
 
 /**
@@ -104,8 +248,9 @@ Note that this function guarantees that the memory is zeroed out
 */
 Value VM::alloc(uint32_t size, Tag tag)
 {
-    // FIXME: use an alloc pool of some kind
-    auto ptr = (refptr)calloc(1, size);
+    countAlloc(roundSize(size), tag);
+
+    auto ptr = (refptr)allocYoung(size);
 
     // Set the tag in the object header
     *(Tag*)ptr = tag;
@@ -114,55 +259,529 @@ Value VM::alloc(uint32_t size, Tag tag)
     return Value(ptr, tag);
 }
 
-void Wrapper::setNextPtr(refptr obj, refptr nextPtr)
+Value VM::allocInterned(uint32_t size)
 {
-    // Get the object header
-    auto header = *(uint64_t*)obj;
+    size = roundSize(size);
+    countAlloc(size, TAG_STRING);
+    bytesAllocated += size;
+    internedSize += size;
 
-    // Set the next pointer
-    *(refptr*)(obj + OBJ_OF_NEXT) = nextPtr;
+    if (heap.size + internedSize >= gcLimit)
+        gcPending = true;
 
-    // Set the next pointer flag bit in the object header
-    *(uint64_t*)(obj) = header | HEADER_MSK_NEXT;
+    // Interned strings get their own allocation, so
+    // that they can be freed one by one
+    auto ptr = (refptr)calloc(1, size);
+    *(Tag*)ptr = TAG_STRING;
+    return Value(ptr, TAG_STRING);
 }
 
-refptr Wrapper::getNextPtr(refptr obj, refptr notFound)
+void VM::freeInterned(refptr ptr)
 {
-    auto header = *(uint64_t*)obj;
-    bool hasNextPtr = header & HEADER_MSK_NEXT;
+    assert (*(uint64_t*)ptr & HEADER_MSK_INTERNED);
+    auto len = *(uint32_t*)(ptr + String::OF_LEN);
+    internedSize -= roundSize(String::memSize(len));
+    free(ptr);
+}
 
-    if (!hasNextPtr)
-        return notFound;
+uint8_t* VM::allocRaw(refptr owner, size_t size)
+{
+    bufferStats.count++;
+    bufferStats.bytes += roundSize(size);
+    countSample(roundSize(size));
 
-    auto nextPtr = *(refptr*)(obj + OBJ_OF_NEXT);
-    assert (nextPtr != nullptr);
+    if (inNursery(owner))
+        return allocYoung(size);
 
-    return nextPtr;
+    return allocBlock(heap, size);
 }
 
-refptr Wrapper::getObjPtr()
+void VM::freeRaw(uint8_t* ptr, size_t size)
 {
-    auto objPtr = (refptr)val;
-    assert (objPtr != nullptr);
-    return getNextPtr(objPtr, objPtr);
+    // Nursery memory is reclaimed when the nursery is emptied
+    if (inNursery(ptr))
+        return;
+
+    peakSize = std::max(peakSize, heapSize());
+
+    size = roundSize(size);
+    heap.size -= size;
+
+    if (size > MAX_CHUNK_ALLOC)
+    {
+        heap.largeBlocks.erase(ptr);
+        free(ptr);
+        return;
+    }
+
+    // Only small blocks are recycled, the space taken by
+    // larger ones stays in their chunk
+    auto numWords = size / sizeof(Word);
+    if (numWords > MAX_SMALL_WORDS)
+        return;
+
+    *(uint8_t**)ptr = freeLists[numWords];
+    freeLists[numWords] = ptr;
 }
 
-String::String(std::string str)
+void VM::addDictShape(refptr owner, Shape* shape)
+{
+    assert (shape->isDictMode());
+
+    if (inNursery(owner))
+        youngDicts.push_back(shape);
+    else
+        oldDicts.push_back(shape);
+}
+
+void VM::addRoot(Value* root)
+{
+    assert (std::find(roots.begin(), roots.end(), root) == roots.end());
+    roots.push_back(root);
+}
+
+void VM::removeRoot(Value* root)
+{
+    // Roots are usually removed in the reverse order of their addition
+    for (size_t i = roots.size(); i > 0; --i)
+    {
+        if (roots[i - 1] == root)
+        {
+            roots.erase(roots.begin() + (i - 1));
+            return;
+        }
+    }
+
+    assert (false && "removing unregistered root");
+}
+
+void VM::addRootFn(RootFn rootFn)
+{
+    rootFns.push_back(rootFn);
+}
+
+void VM::setStressMode(bool enable)
+{
+    stressMode = enable;
+    gcPending = enable;
+}
+
+void VM::remember(refptr ptr)
+{
+    auto& header = *(uint64_t*)ptr;
+
+    if (header & HEADER_MSK_REMEMBERED)
+        return;
+
+    header |= HEADER_MSK_REMEMBERED;
+    rememberedSet.push_back(ptr);
+}
+
+refptr VM::copyObject(refptr ptr)
+{
+    // Minor collections only move nursery objects
+    if (minorGC && !inNursery(ptr))
+        return ptr;
+
+    auto header = *(uint64_t*)ptr;
+
+    if (header & HEADER_MSK_FORWARDED)
+        return *(refptr*)(ptr + HEADER_SIZE);
+
+    refptr newPtr;
+
+    switch ((Tag)header)
+    {
+        case TAG_STRING:
+        {
+            // Interned strings never move. Only major collections
+            // get here for them, and mark them as reached.
+            if (header & HEADER_MSK_INTERNED)
+            {
+                *(uint64_t*)ptr = header | HEADER_MSK_MARKED;
+                return ptr;
+            }
+
+            auto len = *(uint32_t*)(ptr + String::OF_LEN);
+            auto size = String::memSize(len);
+            newPtr = allocBlock(heap, size);
+            memcpy(newPtr, ptr, size);
+        }
+        break;
+
+        // Grown arrays and objects have their contents inlined again
+        case TAG_ARRAY:
+        {
+            auto len = *(uint32_t*)(ptr + Array::OF_LEN);
+            auto cap = *(uint32_t*)(ptr + Array::OF_CAP);
+            newPtr = allocBlock(heap, Array::memSize(cap));
+            memcpy(newPtr, ptr, Array::OF_WORDS);
+
+            auto words = (Word*)(newPtr + Array::OF_DATA);
+            auto tags = (Tag*)(newPtr + Array::OF_DATA + cap * sizeof(Word));
+            memcpy(words, Array::getWords(ptr), len * sizeof(Word));
+            memcpy(tags, Array::getTags(ptr), len * sizeof(Tag));
+            *(Word**)(newPtr + Array::OF_WORDS) = words;
+            *(Tag**)(newPtr + Array::OF_TAGS) = tags;
+
+            // Major collections release the whole old space at once
+            auto oldWords = (uint8_t*)Array::getWords(ptr);
+            if (minorGC && oldWords != ptr + Array::OF_DATA)
+                freeRaw(oldWords, cap * (sizeof(Word) + sizeof(Tag)));
+        }
+        break;
+
+        case TAG_OBJECT:
+        {
+            auto cap = *(uint32_t*)(ptr + Object::OF_CAP);
+            auto shape = Object::getShape(ptr);
+            auto numFields = shape->getNumFields();
+
+            // Dictionary-mode shapes live as long as their object
+            if (shape->isDictMode())
+                shape->marked = true;
+
+            newPtr = allocBlock(heap, Object::memSize(cap));
+            memcpy(newPtr, ptr, Object::OF_FIELDS);
+
+            auto words = (Word*)(newPtr + Object::OF_FIELDS);
+            memcpy(words, Object::getWords(ptr), numFields * sizeof(Word));
+            *(Word**)(newPtr + Object::OF_SLOTS) = words;
+
+            auto oldWords = (uint8_t*)Object::getWords(ptr);
+            if (minorGC && oldWords != ptr + Object::OF_FIELDS)
+                freeRaw(oldWords, cap * sizeof(Word));
+        }
+        break;
+
+        case TAG_IMGREF:
+        newPtr = allocBlock(heap, ImgRef::SIZE);
+        memcpy(newPtr, ptr, ImgRef::SIZE);
+        break;
+
+        default:
+        assert (false && "invalid tag in object header");
+        return ptr;
+    }
+
+    // The copy is not in the remembered set
+    *(uint64_t*)newPtr = header & ~HEADER_MSK_REMEMBERED;
+
+    // Leave the new location in the old copy
+    *(uint64_t*)ptr = header | HEADER_MSK_FORWARDED;
+    *(refptr*)(ptr + HEADER_SIZE) = newPtr;
+
+    copiedObjs.push_back(newPtr);
+
+    return newPtr;
+}
+
+void VM::scanObject(refptr ptr)
 {
-    auto len = str.length();
+    switch (*(Tag*)ptr)
+    {
+        case TAG_ARRAY:
+        {
+            auto len = *(uint32_t*)(ptr + Array::OF_LEN);
+            auto words = Array::getWords(ptr);
+            auto tags = Array::getTags(ptr);
+
+            for (size_t i = 0; i < len; ++i)
+            {
+                auto elem = Value(words[i], tags[i]);
+                forward(elem);
+                words[i] = elem.getWord();
+            }
+        }
+        break;
+
+        case TAG_OBJECT:
+        {
+            auto shape = Object::getShape(ptr);
+            auto words = Object::getWords(ptr);
+
+            for (uint32_t i = 0; i < shape->getNumFields(); ++i)
+            {
+                auto field = Value(words[i], shape->getFieldTag(i));
+                forward(field);
+                words[i] = field.getWord();
+            }
+        }
+        break;
 
+        case TAG_IMGREF:
+        {
+            auto& symPtr = *(refptr*)(ptr + ImgRef::OF_SYM);
+            symPtr = forward(symPtr);
+        }
+        break;
+
+        default:
+        break;
+    }
+}
+
+void VM::forward(Value& val)
+{
+    if (val.isPointer())
+        val = Value(forward(val.getWord().ptr), val.getTag());
+}
+
+refptr VM::forward(refptr ptr)
+{
+    if (!ptr)
+        return nullptr;
+
+    return copyObject(ptr);
+}
+
+/// Get the time elapsed since a given time point, in milliseconds
+static double elapsedMs(std::chrono::steady_clock::time_point startTime)
+{
+    auto elapsed = std::chrono::steady_clock::now() - startTime;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+void VM::copyReachable()
+{
+    for (auto root : roots)
+        forward(*root);
+
+    for (auto rootFn : rootFns)
+        rootFn();
+
+    while (!copiedObjs.empty())
+    {
+        auto ptr = copiedObjs.back();
+        copiedObjs.pop_back();
+        scanObject(ptr);
+    }
+}
+
+void VM::resetNursery()
+{
+    memset(nurseryStart, 0, nurseryPtr - nurseryStart);
+    nurseryPtr = nurseryStart;
+}
+
+void VM::collect()
+{
+    auto startTime = std::chrono::steady_clock::now();
+    peakSize = std::max(peakSize, heapSize());
+
+    // Live objects are copied into a fresh heap
+    auto fromSpace = std::move(heap);
+    heap = Space();
+
+    for (auto& freeList : freeLists)
+        freeList = nullptr;
+
+    // Copies are not counted as allocations
+    auto prevAllocated = bytesAllocated;
+
+    copyReachable();
+    sweepDicts();
+    sweepInterned();
+
+    fromSpace.release();
+    resetNursery();
+    rememberedSet.clear();
+
+    bytesAllocated = prevAllocated;
+
+    // Let the heap grow to twice the size of the live objects
+    gcLimit = std::max((size_t)MIN_HEAP_LIMIT, 2 * (heap.size + internedSize));
+    gcPending = stressMode;
+
+    auto pause = elapsedMs(startTime);
+    numMajorGCs++;
+    totalMajorPause += pause;
+    maxMajorPause = std::max(maxMajorPause, pause);
+}
+
+void VM::collectNursery()
+{
+    auto startTime = std::chrono::steady_clock::now();
+    peakSize = std::max(peakSize, heapSize());
+    auto prevAllocated = bytesAllocated;
+
+    // Live nursery objects are promoted to the old space. The old
+    // objects referring to them are either roots or remembered.
+    minorGC = true;
+
+    for (auto ptr : rememberedSet)
+    {
+        *(uint64_t*)ptr &= ~HEADER_MSK_REMEMBERED;
+        scanObject(ptr);
+    }
+    rememberedSet.clear();
+
+    copyReachable();
+    sweepDicts();
+
+    minorGC = false;
+    resetNursery();
+
+    bytesAllocated = prevAllocated;
+    gcPending = stressMode || heap.size + internedSize >= gcLimit;
+
+    auto pause = elapsedMs(startTime);
+    numMinorGCs++;
+    totalMinorPause += pause;
+    maxMinorPause = std::max(maxMinorPause, pause);
+
+    size_t bucket = 0;
+    while (bucket < NUM_PAUSE_BUCKETS && pause >= PAUSE_BUCKETS[bucket])
+        bucket++;
+    pauseCounts[bucket]++;
+}
+
+void VM::sweepDicts()
+{
+    // Minor collections only find nursery objects dead
+    std::vector<Shape*> dicts;
+    std::swap(dicts, youngDicts);
+    if (!minorGC)
+    {
+        dicts.insert(dicts.end(), oldDicts.begin(), oldDicts.end());
+        oldDicts.clear();
+    }
+
+    for (auto dict : dicts)
+    {
+        if (!dict->marked)
+        {
+            delete dict;
+            continue;
+        }
+
+        dict->marked = false;
+        oldDicts.push_back(dict);
+
+        // Field names are not traced through shapes,
+        // so the names of live dictionaries are marked here
+        if (!minorGC)
+        {
+            for (auto name : dict->dictNames)
+                *(uint64_t*)(refptr)name |= HEADER_MSK_MARKED;
+        }
+    }
+}
+
+void VM::collectPending()
+{
+    // In stress mode, every safepoint collects, and
+    // a fraction of these collections are major
+    bool major = stressMode?
+        getNumCollections() % STRESS_MAJOR_PERIOD == 0:
+        heap.size + internedSize >= gcLimit;
+
+    if (major)
+        collect();
+    else
+        collectNursery();
+}
+
+void VM::printHeapStats() const
+{
+    auto printStats = [](std::string name, const AllocStats& stats)
+    {
+        std::cout << "  " << name << ": " << stats.count << " blocks, ";
+        std::cout << stats.bytes << " bytes" << std::endl;
+    };
+
+    std::cout << "heap stats" << std::endl;
+    std::cout << "  bytes allocated: " << bytesAllocated << std::endl;
+    std::cout << "  heap size: " << heapSize();
+    std::cout << " (peak " << peakHeapSize() << ")" << std::endl;
+
+    printStats("strings", tagStats[TAG_STRING]);
+    printStats("arrays", tagStats[TAG_ARRAY]);
+    printStats("objects", tagStats[TAG_OBJECT]);
+    printStats("image refs", tagStats[TAG_IMGREF]);
+    printStats("grown storage", bufferStats);
+
+    for (size_t i = 0; i < NUM_SIZE_BUCKETS; ++i)
+    {
+        auto name = (i + 1 < NUM_SIZE_BUCKETS)?
+            "<= " + std::to_string(sizeBucketLimit(i)) + " bytes":
+            "> " + std::to_string(sizeBucketLimit(i - 1)) + " bytes";
+        printStats(name, sizeStats[i]);
+    }
+}
+
+void VM::printGCStats() const
+{
+    std::cout << "gc stats" << std::endl;
+    std::cout << "  bytes allocated: " << bytesAllocated << std::endl;
+    std::cout << "  heap size: " << heapSize() << std::endl;
+
+    std::cout << "  minor collections: " << numMinorGCs;
+    if (numMinorGCs > 0)
+    {
+        std::cout << " (mean pause " << totalMinorPause / numMinorGCs;
+        std::cout << " ms, max " << maxMinorPause << " ms)";
+    }
+    std::cout << std::endl;
+
+    std::cout << "  major collections: " << numMajorGCs;
+    if (numMajorGCs > 0)
+    {
+        std::cout << " (mean pause " << totalMajorPause / numMajorGCs;
+        std::cout << " ms, max " << maxMajorPause << " ms)";
+    }
+    std::cout << std::endl;
+
+    // Histogram of minor collection pause times
+    for (size_t i = 0; i <= NUM_PAUSE_BUCKETS; ++i)
+    {
+        if (pauseCounts[i] == 0)
+            continue;
+
+        if (i < NUM_PAUSE_BUCKETS)
+            std::cout << "  minor pauses < " << PAUSE_BUCKETS[i] << " ms: ";
+        else
+            std::cout << "  minor pauses >= " << PAUSE_BUCKETS[i - 1] << " ms: ";
+        std::cout << pauseCounts[i] << std::endl;
+    }
+}
+
+/// Table of interned strings, indexed by their contents. This is
+/// never destroyed, so that it remains usable from exit handlers.
+static std::unordered_map<std::string, Value>& getInternTable()
+{
+    static auto internTable = new std::unordered_map<std::string, Value>();
+    return *internTable;
+}
+
+Value String::newString(const char* data, size_t len, bool interned)
+{
     // Compute the string object size
     auto numBytes = memSize(len);
 
     // Allocate memory
-    val = vm.alloc(numBytes, TAG_STRING);
+    auto val = (
+        interned?
+        vm.allocInterned(numBytes):
+        vm.alloc(numBytes, TAG_STRING)
+    );
     auto ptr = (refptr)val;
 
     // Set the string length
     *(uint32_t*)(ptr + OF_LEN) = len;
 
-    // Copy the string data
-    strcpy((char*)(ptr + OF_DATA), str.c_str());
+    // Copy the string data, the terminator is already zeroed
+    memcpy(ptr + OF_DATA, data, len);
+
+    return val;
+}
+
+String::String(std::string str)
+{
+    if (isValidIdent(str))
+        val = intern(str);
+    else
+        val = newString(str.data(), str.length());
 }
 
 String::String(Value value)
@@ -190,20 +809,136 @@ const char* String::getDataPtr() const
 /// Casting operator to extract a string value
 String::operator std::string ()
 {
+    return std::string(getDataPtr(), length());
+}
+
+bool String::operator == (const char* that) const
+{
+    return strcmp(getDataPtr(), that) == 0;
+}
+
+bool String::operator == (String that) const
+{
+    if ((refptr)val == (refptr)that.val)
+        return true;
+
+    if (isInterned() && that.isInterned())
+        return false;
+
     auto len = length();
+    return (
+        len == that.length() &&
+        memcmp(getDataPtr(), that.getDataPtr(), len) == 0
+    );
+}
 
-    std::string str;
-    str.reserve(len);
+void String::setInterned(Value str)
+{
+    auto ptr = (refptr)str;
+    auto data = ptr + OF_DATA;
+    auto len = *(uint32_t*)(ptr + OF_LEN);
 
+    // FNV-1a hash of the string contents
+    uint32_t hash = 2166136261u;
     for (size_t i = 0; i < len; ++i)
-        str += (*this)[i];
+    {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
 
-    return str;
+    auto header = *(uint64_t*)ptr;
+    header |= HEADER_MSK_INTERNED;
+    header |= (uint64_t)hash << HEADER_IDX_HASH;
+    *(uint64_t*)ptr = header;
 }
 
-bool String::operator == (const char* that) const
+uint32_t String::getHash() const
 {
-    return strcmp(getDataPtr(), that) == 0;
+    assert (isInterned());
+    auto header = *(uint64_t*)(refptr)val;
+    return (uint32_t)(header >> HEADER_IDX_HASH);
+}
+
+bool String::isInterned() const
+{
+    auto header = *(uint64_t*)(refptr)val;
+    return header & HEADER_MSK_INTERNED;
+}
+
+String String::intern(String str)
+{
+    if (str.isInterned())
+        return str;
+
+    return intern((std::string)str);
+}
+
+String String::intern(std::string str)
+{
+    auto& table = getInternTable();
+
+    auto itr = table.find(str);
+    if (itr != table.end())
+        return String(itr->second);
+
+    // Interned strings never move, so that shapes and
+    // inline caches can refer to them by address
+    auto val = newString(str.data(), str.length(), true);
+    setInterned(val);
+    table[str] = val;
+
+    return String(val);
+}
+
+void String::pin()
+{
+    assert (isInterned());
+    *(uint64_t*)(refptr)val |= HEADER_MSK_PINNED;
+}
+
+String String::internPinned(String str)
+{
+    auto interned = intern(str);
+    interned.pin();
+    return interned;
+}
+
+void VM::sweepInterned()
+{
+    auto& table = getInternTable();
+
+    for (auto itr = table.begin(); itr != table.end();)
+    {
+        auto ptr = (refptr)itr->second;
+        auto& header = *(uint64_t*)ptr;
+
+        if (header & HEADER_MSK_PINNED)
+        {
+            ++itr;
+            continue;
+        }
+
+        if (header & HEADER_MSK_MARKED)
+        {
+            header &= ~HEADER_MSK_MARKED;
+            ++itr;
+            continue;
+        }
+
+        itr = table.erase(itr);
+        freeInterned(ptr);
+    }
+}
+
+Value String::findInterned(const char* data, size_t len)
+{
+    auto& table = getInternTable();
+
+    auto itr = table.find(std::string(data, len));
+    if (itr != table.end())
+        return itr->second;
+
+    return Value::UNDEF;
 }
 
 /// Get the ith character code
@@ -221,15 +956,12 @@ String String::concat(String a, String b)
     auto lenB = b.length();
 
     std::string c;
-    c.resize(lenA + lenB);
-
-    for (size_t i = 0; i < lenA; ++i)
-        c[i] = a[i];
+    c.reserve(lenA + lenB);
+    c.append(a.getDataPtr(), lenA);
+    c.append(b.getDataPtr(), lenB);
 
-    for (size_t i = 0; i < lenB; ++i)
-        c[lenA + i] = b[i];
-
-    return String(c);
+    // Concatenated strings are not interned, see String::intern
+    return String(newString(c.data(), c.length()));
 }
 
 /// Allocate a new array of a given length
@@ -246,6 +978,10 @@ Array::Array(size_t minCap)
     *(uint32_t*)(ptr + OF_CAP) = minCap;
     *(uint32_t*)(ptr + OF_LEN) = 0;
 
+    // The elements are initially stored inline
+    *(Word**)(ptr + OF_WORDS) = (Word*)(ptr + OF_DATA);
+    *(Tag**)(ptr + OF_TAGS) = (Tag*)(ptr + OF_DATA + minCap * sizeof(Word));
+
     // No initialization necessary because vm.alloc
     // provides zeroed out memory, initialized to all zeroes,
     // which evaluates to $undef.
@@ -275,30 +1011,23 @@ uint32_t Array::length()
 void Array::setElem(size_t i, Value v)
 {
     auto ptr = getObjPtr();
-    auto cap = length();
-
-    auto words = (Word*)(ptr + OF_DATA);
-    auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
 
     assert (length() <= getCap());
     assert (i < length());
-    words[i] = v.getWord();
-    tags[i] = v.getTag();
+    getWords(ptr)[i] = v.getWord();
+    getTags(ptr)[i] = v.getTag();
+    vm.writeBarrier(ptr, v);
 }
 
 /// Get the value of the ith element
 Value Array::getElem(size_t i)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
-
-    auto words = (Word*)(ptr + OF_DATA);
-    auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
 
     assert (length() <= getCap());
     assert (i < length());
-    auto word = words[i];
-    auto tag = tags[i];
+    auto word = getWords(ptr)[i];
+    auto tag = getTags(ptr)[i];
 
     return Value(word, tag);
 }
@@ -313,31 +1042,28 @@ void Array::push(Value val)
     // If the array is at capacity
     if (len == cap)
     {
-        // Create a new array with twice the capacity
+        // Move the elements to a buffer with twice the capacity
         auto newCap = 2 * cap + 1;
-        //std::cerr << "extending array capacity from " << cap << " to " << newCap << std::endl;
-        auto newArr = Array(newCap);
-
-        // Copy elements to the new array
-        for (size_t i = 0; i < len; ++i)
-            newArr.push(getElem(i));
-
-        // Set the next pointer on this object
-        auto rootObjPtr = (refptr)this->val;
-        setNextPtr(rootObjPtr, newArr.getObjPtr());
-        assert (getObjPtr() != ptr);
-
-        ptr = getObjPtr();
-        cap = newCap;
-
-        //std::cout << "done extending array" << std::endl;
+        auto words = getWords(ptr);
+        auto tags = getTags(ptr);
+        auto buffer = vm.allocRaw(ptr, newCap * (sizeof(Word) + sizeof(Tag)));
+        auto newWords = (Word*)buffer;
+        auto newTags = (Tag*)(buffer + newCap * sizeof(Word));
+        memcpy(newWords, words, len * sizeof(Word));
+        memcpy(newTags, tags, len * sizeof(Tag));
+
+        // Free the previous buffer, unless the elements were inline
+        if ((refptr)words != ptr + OF_DATA)
+            vm.freeRaw((uint8_t*)words, cap * (sizeof(Word) + sizeof(Tag)));
+
+        *(Word**)(ptr + OF_WORDS) = newWords;
+        *(Tag**)(ptr + OF_TAGS) = newTags;
+        *(uint32_t*)(ptr + OF_CAP) = newCap;
     }
 
-    auto words = (Word*)(ptr + OF_DATA);
-    auto tags  = (Tag*) (ptr + OF_DATA + cap * sizeof(Word));
-
-    words[len] = val.getWord();
-    tags[len] = val.getTag();
+    getWords(ptr)[len] = val.getWord();
+    getTags(ptr)[len] = val.getTag();
+    vm.writeBarrier(ptr, val);
 
     // Increment the length
     *(uint32_t*)(ptr + OF_LEN) = len + 1;
@@ -361,11 +1087,226 @@ Array Array::concat(Array a, Array b)
 }
 */
 
+Shape::Shape(Shape* parent, Value fieldName, Tag fieldTag)
+: parent(parent),
+  fieldName(fieldName),
+  fieldTag(fieldTag),
+  numFields(parent? (parent->numFields + 1):0)
+{
+    if (parent)
+    {
+        fieldTags = parent->fieldTags;
+        fieldTags.push_back(fieldTag);
+    }
+}
+
+/// Key of a child shape in the transition table. Tags fit in
+/// the low byte, and heap pointers in the remaining 56 bits.
+static uintptr_t childKey(refptr fieldName, Tag fieldTag)
+{
+    return ((uintptr_t)fieldName << 8) | fieldTag;
+}
+
+Shape* Shape::getEmpty()
+{
+    static Shape* emptyShape = new Shape(nullptr, Value::UNDEF, TAG_UNDEF);
+    return emptyShape;
+}
+
+Shape* Shape::toDict() const
+{
+    auto dict = new Shape(nullptr, Value::UNDEF, TAG_UNDEF);
+    dict->isDict = true;
+
+    // Collect the field names from the shape tree, in slot order
+    std::vector<Value> names(numFields);
+    for (auto shape = this; shape->parent; shape = shape->parent)
+        names[shape->numFields - 1] = shape->fieldName;
+
+    for (uint32_t i = 0; i < numFields; ++i)
+        dict->dictAdd(names[i], fieldTags[i]);
+
+    return dict;
+}
+
+void Shape::dictAdd(Value fieldName, Tag fieldTag)
+{
+    assert (isDict);
+
+    auto slotIdx = numFields;
+    dictNames.push_back(fieldName);
+    fieldTags.push_back(fieldTag);
+    numFields++;
+
+    // Keep the table at most half full, with a power of two size
+    if (2 * numFields > dictIndex.size())
+    {
+        size_t tableSize = 16;
+        while (tableSize < 4 * (size_t)numFields)
+            tableSize *= 2;
+        dictIndex.assign(tableSize, 0);
+
+        for (uint32_t i = 0; i < numFields; ++i)
+        {
+            auto mask = dictIndex.size() - 1;
+            auto idx = String(dictNames[i]).getHash() & mask;
+            while (dictIndex[idx] != 0)
+                idx = (idx + 1) & mask;
+            dictIndex[idx] = i + 1;
+        }
+
+        return;
+    }
+
+    auto mask = dictIndex.size() - 1;
+    auto idx = String(fieldName).getHash() & mask;
+    while (dictIndex[idx] != 0)
+        idx = (idx + 1) & mask;
+    dictIndex[idx] = slotIdx + 1;
+}
+
+Shape* Shape::addInterned(Value name, Tag tag)
+{
+    if (isDict)
+    {
+        dictAdd(name, tag);
+        return this;
+    }
+
+    // Large objects switch to dictionary mode
+    if (numFields >= DICT_THRESHOLD)
+    {
+        auto dict = toDict();
+        dict->dictAdd(name, tag);
+        return dict;
+    }
+
+    auto key = childKey((refptr)name, tag);
+    auto itr = children.find(key);
+    if (itr != children.end())
+        return itr->second;
+
+    // Inline caches refer to the names of the shape tree
+    String(name).pin();
+
+    auto child = new Shape(this, name, tag);
+    children[key] = child;
+    return child;
+}
+
+Shape* Shape::addField(String fieldName, Tag fieldTag)
+{
+    return addInterned(String::intern(fieldName), fieldTag);
+}
+
+Shape* Shape::setFieldTag(uint32_t slotIdx, Tag tag)
+{
+    assert (slotIdx < numFields);
+
+    if (fieldTags[slotIdx] == tag)
+        return this;
+
+    // Dictionary-mode shapes belong to a single object
+    if (isDict)
+    {
+        fieldTags[slotIdx] = tag;
+        return this;
+    }
+
+    // Find the shape adding this field, collecting the shapes after it
+    std::vector<const Shape*> later;
+    auto shape = this;
+    while (shape->numFields > slotIdx + 1)
+    {
+        later.push_back(shape);
+        shape = shape->parent;
+    }
+
+    // Add the field with its new tag, then replay the later fields
+    auto newShape = shape->parent->addInterned(shape->fieldName, tag);
+    for (auto itr = later.rbegin(); itr != later.rend(); ++itr)
+        newShape = newShape->addInterned((*itr)->fieldName, (*itr)->fieldTag);
+
+    return newShape;
+}
+
+uint32_t Shape::getSlotIdx(refptr namePtr) const
+{
+    if (isDict)
+    {
+        auto mask = dictIndex.size() - 1;
+        auto hash = (uint32_t)(*(uint64_t*)namePtr >> HEADER_IDX_HASH);
+
+        for (auto idx = hash & mask; dictIndex[idx] != 0; idx = (idx + 1) & mask)
+        {
+            auto slotIdx = dictIndex[idx] - 1;
+            if ((refptr)dictNames[slotIdx] == namePtr)
+                return slotIdx;
+        }
+
+        return numFields;
+    }
+
+    // Walk up the shape tree, from the most recently added field
+    for (auto shape = this; shape->parent; shape = shape->parent)
+    {
+        if ((refptr)shape->fieldName == namePtr)
+            return shape->numFields - 1;
+    }
+
+    return numFields;
+}
+
+uint32_t Shape::getSlotIdx(const char* name, size_t nameLen) const
+{
+    // Field names are interned, so if there is no interned
+    // string with this name, no shape has this field
+    auto namePtr = String::findInterned(name, nameLen);
+    if (namePtr == Value::UNDEF)
+        return numFields;
+
+    return getSlotIdx((refptr)namePtr);
+}
+
+uint32_t Shape::getSlotIdx(String name) const
+{
+    if (name.isInterned())
+        return getSlotIdx((refptr)name);
+
+    return getSlotIdx(name.getDataPtr(), name.length());
+}
+
+std::string Shape::getFieldName(uint32_t slotIdx) const
+{
+    assert (slotIdx < numFields);
+
+    if (isDict)
+        return dictNames[slotIdx];
+
+    auto shape = this;
+    while (shape->numFields > slotIdx + 1)
+        shape = shape->parent;
+
+    return shape->fieldName;
+}
+
+size_t Object::sizeClass(size_t numFields)
+{
+    // Size classes are the powers of two and the midpoints
+    // between them: 2, 3, 4, 6, 8, 12, 16, 24, ...
+    size_t cap = 2;
+    while (cap < numFields)
+        cap = (cap & (cap - 1))? (cap / 3 * 4):(cap + cap / 2);
+
+    return cap;
+}
+
 /// Allocate a new empty object
 Object Object::newObject(size_t cap)
 {
-    if (cap < MIN_CAP)
-        cap = MIN_CAP;
+    // Objects are allocated at the exact size requested
+    if (cap == 0)
+        cap = DEFAULT_CAP;
 
     // Compute the object size
     auto numBytes = memSize(cap);
@@ -374,16 +1315,88 @@ Object Object::newObject(size_t cap)
     auto val = vm.alloc(numBytes, TAG_OBJECT);
     auto ptr = (refptr)val;
 
-    // Set the object capacity
+    // Set the object capacity, the fields are initially stored inline
     *(uint32_t*)(ptr + OF_CAP) = cap;
+    *(Word**)(ptr + OF_SLOTS) = (Word*)(ptr + OF_FIELDS);
 
-    // TODO: init object shape, when shapes actually implemented!
+    // New objects start out with no fields
+    *(Shape**)(ptr + OF_SHAPE) = Shape::getEmpty();
 
     // No field initialization necessary
 
     return val;
 }
 
+Object Object::newObject(ObjLitCache& cache, const Value* stackVals)
+{
+    auto numFields = cache.names.size();
+    auto obj = newObject(numFields);
+    auto ptr = obj.getObjPtr();
+
+    if (cache.repeatedNames)
+    {
+        // Add the fields one by one, so that repeated
+        // names keep the last value given
+        for (size_t i = 0; i < numFields; ++i)
+            obj.setField(String(cache.names[i]), stackVals[numFields - 1 - i]);
+
+        return obj;
+    }
+
+    // Find a cached shape whose field tags match the values
+    Shape* shape = nullptr;
+    for (size_t j = 0; j < cache.numShapes && !shape; ++j)
+    {
+        shape = cache.shapes[j];
+
+        for (size_t i = 0; i < numFields; ++i)
+        {
+            if (shape->getFieldTag(i) != stackVals[numFields - 1 - i].getTag())
+            {
+                shape = nullptr;
+                break;
+            }
+        }
+    }
+
+    if (!shape)
+    {
+        shape = Shape::getEmpty();
+        for (size_t i = 0; i < numFields; ++i)
+            shape = shape->addField(cache.names[i], stackVals[numFields - 1 - i].getTag());
+
+        // Dictionary-mode shapes belong to a single object
+        if (shape->isDictMode())
+        {
+            vm.addDictShape(ptr, shape);
+        }
+        else
+        {
+            if (cache.numShapes < ObjLitCache::NUM_SHAPES)
+            {
+                cache.shapes[cache.numShapes++] = shape;
+            }
+            else
+            {
+                cache.shapes[cache.nextShape] = shape;
+                cache.nextShape = (cache.nextShape + 1) % ObjLitCache::NUM_SHAPES;
+            }
+        }
+    }
+
+    setShape(ptr, shape);
+
+    auto words = getWords(ptr);
+    for (size_t i = 0; i < numFields; ++i)
+    {
+        auto val = stackVals[numFields - 1 - i];
+        words[i] = val.getWord();
+        vm.writeBarrier(ptr, val);
+    }
+
+    return obj;
+}
+
 Object::Object(Value value)
 {
     assert (value.getTag() == TAG_OBJECT);
@@ -399,137 +1412,335 @@ size_t Object::getCap()
     return cap;
 }
 
-size_t Object::getSlotIdx(
+/// Size of the global cache used by megamorphic field sites
+const size_t MEGA_CACHE_SIZE = 1024;
+
+/// Global cache used by megamorphic field sites, direct-mapped
+static FieldCache::Entry megaCache[MEGA_CACHE_SIZE];
+
+static size_t megaCacheIdx(const Shape* shape, refptr name)
+{
+    auto hash = ((uintptr_t)shape >> 3) ^ ((uintptr_t)name >> 2);
+    return hash & (MEGA_CACHE_SIZE - 1);
+}
+
+const FieldCache::Entry* FieldCache::findMega(const Shape* shape, refptr name)
+{
+    auto& entry = megaCache[megaCacheIdx(shape, name)];
+
+    if (entry.shape == shape && entry.name == name)
+        return &entry;
+
+    return nullptr;
+}
+
+void FieldCache::addEntry(
+    const Shape* shape,
+    refptr name,
+    Shape* newShape,
+    uint32_t slotIdx,
+    Tag tag
+)
+{
+    // Dictionary-mode shapes change in place, and are
+    // freed along with their object
+    if (shape->isDictMode())
+        return;
+
+    if (!megamorphic && numEntries == NUM_ENTRIES)
+    {
+        polyFieldSites--;
+        megaFieldSites++;
+        megamorphic = true;
+    }
+
+    if (megamorphic)
+    {
+        megaCache[megaCacheIdx(shape, name)] = { shape, name, newShape, slotIdx, tag };
+        return;
+    }
+
+    if (numEntries == 0)
+        monoFieldSites++;
+    else if (numEntries == 1)
+    {
+        monoFieldSites--;
+        polyFieldSites++;
+    }
+
+    entries[numEntries++] = { shape, name, newShape, slotIdx, tag };
+}
+
+uint32_t Object::getSlotIdx(
     refptr ptr,
-    size_t cap,
     String fieldName,
-    bool newField
+    FieldCache& cache,
+    Tag& tag
 )
 {
-    auto values = (Value*)(ptr + OF_FIELDS);
+    auto shape = getShape(ptr);
 
-    // FIXME: for now, we use a dumb key-pair linear search strategy
-    size_t idx = 0;
-    for (; idx < cap; idx += 2)
+    // Transition entries are for shapes without the field,
+    // and their slot index is the field count
+    auto entry = cache.find(shape, fieldName);
+    if (entry)
     {
-        // Empty slot, property name not found
-        if (values[idx] == Value::UNDEF)
-            return newField? idx:cap;
+        fieldCacheHits++;
+        tag = entry->tag;
+        return entry->slotIdx;
+    }
+
+    fieldCacheMisses++;
 
-        assert (values[idx].isString());
+    auto slotIdx = shape->getSlotIdx(fieldName);
+
+    if (slotIdx < shape->getNumFields())
+    {
+        tag = shape->getFieldTag(slotIdx);
 
-        // Slot found
-        if ((String)values[idx] == fieldName)
-            return idx;
+        // Only interned names are cached. The names of the shape
+        // tree are pinned, so they outlive the cache entries.
+        if (fieldName.isInterned())
+            cache.addEntry(shape, fieldName, nullptr, slotIdx, tag);
     }
 
-    return cap;
+    return slotIdx;
 }
 
-bool Object::hasField(String fieldName)
+void Object::addField(String name, Value value)
 {
     auto ptr = getObjPtr();
     auto cap = getCap();
+    auto shape = getShape(ptr);
+    auto slotIdx = shape->getNumFields();
+
+    // If we've exceeded the object capacity
+    if (slotIdx >= cap)
+    {
+        // Move the fields to a buffer of the next size class
+        assert (cap > 0);
+        auto newCap = sizeClass(cap + 1);
+        auto words = getWords(ptr);
+        auto newWords = (Word*)vm.allocRaw(ptr, newCap * sizeof(Word));
+        memcpy(newWords, words, cap * sizeof(Word));
+
+        // Free the previous buffer, unless the fields were inline
+        if ((refptr)words != ptr + OF_FIELDS)
+            vm.freeRaw((uint8_t*)words, cap * sizeof(Word));
 
-    auto slotIdx = getSlotIdx(ptr, cap, fieldName, false);
+        *(Word**)(ptr + OF_SLOTS) = newWords;
+        *(uint32_t*)(ptr + OF_CAP) = newCap;
+    }
+
+    // Transition to the shape with the new field
+    auto newShape = shape->addField(name, value.getTag());
+    setShape(ptr, newShape);
+
+    if (newShape != shape && newShape->isDictMode())
+        vm.addDictShape(ptr, newShape);
+
+    // Write the new field value
+    getWords(ptr)[slotIdx] = value.getWord();
+    vm.writeBarrier(ptr, value);
+}
 
-    return (slotIdx < cap);
+bool Object::hasField(String fieldName)
+{
+    auto shape = getShape(getObjPtr());
+    return shape->getSlotIdx(fieldName) < shape->getNumFields();
 }
 
 void Object::setField(String name, Value value)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
+    auto shape = getShape(ptr);
+    auto slotIdx = shape->getSlotIdx(name);
 
-    auto slotIdx = getSlotIdx(ptr, cap, name, true);
+    if (slotIdx >= shape->getNumFields())
+    {
+        addField(name, value);
+        return;
+    }
 
-    // If we've exceeded the object capacity
-    if (slotIdx >= cap)
+    setShape(ptr, shape->setFieldTag(slotIdx, value.getTag()));
+    getWords(ptr)[slotIdx] = value.getWord();
+    vm.writeBarrier(ptr, value);
+}
+
+Value Object::getField(String name)
+{
+    auto ptr = getObjPtr();
+    auto shape = getShape(ptr);
+    auto slotIdx = shape->getSlotIdx(name);
+
+    assert (slotIdx < shape->getNumFields());
+    return Value(getWords(ptr)[slotIdx], shape->getFieldTag(slotIdx));
+}
+
+bool Object::getProp(String name, Value& value, PropCache& cache)
+{
+    // Follow the cached path, checking the shape of each object
+    if ((refptr)name == cache.name && cache.numShapes > 0)
     {
-        // Create a new object with twice the capacity
-        assert (cap > 0);
-        auto newCap = 2 * cap;
-        std::cerr << "extending object capacity from " << cap << " to " << newCap << std::endl;
-        auto newObj = Object::newObject(newCap);
+        auto ptr = getObjPtr();
+
+        // The proto fields of the cached shapes are tagged as objects
+        for (size_t i = 0; getShape(ptr) == cache.shapes[i]; ++i)
+        {
+            auto word = getWords(ptr)[cache.slots[i]];
+
+            if (i + 1 == cache.numShapes)
+            {
+                propCacheHits++;
+                value = Value(word, cache.tag);
+                return true;
+            }
+
+            ptr = Object(Value(word, TAG_OBJECT)).getObjPtr();
+        }
+    }
+
+    propCacheMisses++;
+
+    static String protoName = String::internPinned(String("proto"));
+
+    // Only interned names are cached, and dictionary-mode objects
+    // are not, as they change in place rather than changing shape
+    PropCache newCache;
+    bool cacheable = name.isInterned();
 
-        // Copy properties to the new object
-        for (auto itr = ObjFieldItr(*this); itr.valid(); itr.next())
+    auto ptr = getObjPtr();
+
+    for (size_t depth = 0;; ++depth)
+    {
+        auto shape = getShape(ptr);
+        auto words = getWords(ptr);
+
+        if (depth >= PropCache::MAX_DEPTH)
+            cacheable = false;
+        else
+            newCache.shapes[depth] = shape;
+
+        auto slotIdx = shape->getSlotIdx(name);
+
+        if (slotIdx < shape->getNumFields())
         {
-            auto fieldName = itr.get();
-            auto fieldVal = getField(fieldName);
-            newObj.setField(fieldName, fieldVal);
+            if (cacheable && !shape->isDictMode())
+            {
+                newCache.name = name;
+                newCache.slots[depth] = slotIdx;
+                newCache.numShapes = depth + 1;
+                newCache.tag = shape->getFieldTag(slotIdx);
+                cache = newCache;
+            }
+
+            value = Value(words[slotIdx], shape->getFieldTag(slotIdx));
+            return true;
         }
 
-        // Set the next pointer on this object
-        auto newObjPtr = newObj.getObjPtr();
-        auto rootObjPtr = (refptr)val;
-        setNextPtr(rootObjPtr, newObjPtr);
-        assert (getObjPtr() != ptr);
+        auto protoIdx = shape->getSlotIdx(protoName);
+        if (protoIdx >= shape->getNumFields())
+            return false;
+
+        if (shape->getFieldTag(protoIdx) != TAG_OBJECT)
+            return false;
+        auto protoVal = Value(words[protoIdx], TAG_OBJECT);
+
+        if (shape->isDictMode())
+            cacheable = false;
+        else if (cacheable)
+            newCache.slots[depth] = protoIdx;
 
-        ptr = getObjPtr();
-        cap = getCap();
+        ptr = Object(protoVal).getObjPtr();
     }
+}
 
-    // Write the new property
-    assert (slotIdx + 1 < cap);
-    auto values = (Value*)(ptr + OF_FIELDS);
-    values[slotIdx + 0] = name;
-    values[slotIdx + 1] = value;
+bool Object::hasField(String name, FieldCache& cache)
+{
+    auto ptr = getObjPtr();
+    Tag tag;
+    auto slotIdx = getSlotIdx(ptr, name, cache, tag);
+    return slotIdx < getShape(ptr)->getNumFields();
 }
 
-Value Object::getField(String name)
+bool Object::getField(String name, Value& value, FieldCache& cache)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
-    auto values = (Value*)(ptr + OF_FIELDS);
+    Tag tag;
+    auto slotIdx = getSlotIdx(ptr, name, cache, tag);
 
-    size_t slotIdx = getSlotIdx(ptr, cap, name, false);
+    if (slotIdx >= getShape(ptr)->getNumFields())
+        return false;
 
-    assert (slotIdx < cap);
-    return values[slotIdx + 1];
+    value = Value(getWords(ptr)[slotIdx], tag);
+    return true;
 }
 
-bool Object::getField(const char* name, Value& value, size_t& idxCache)
+bool Object::setFieldCached(String name, Value value, FieldCache& cache)
 {
     auto ptr = getObjPtr();
-    auto cap = getCap();
-    auto values = (Value*)(ptr + OF_FIELDS);
 
-    //std::cout << "Lookup" << std::endl;
-    //std::cout << "  name=" << name << std::endl;
-    //std::cout << "  idxCache=" << idxCache << std::endl;
+    auto entry = cache.find(getShape(ptr), name, value.getTag());
+    if (!entry || entry->newShape)
+        return false;
+
+    fieldCacheHits++;
+    getWords(ptr)[entry->slotIdx] = value.getWord();
+    vm.writeBarrier(ptr, value);
+    return true;
+}
+
+void Object::setField(String name, Value value, FieldCache& cache)
+{
+    if (setFieldCached(name, value, cache))
+        return;
+
+    auto ptr = getObjPtr();
+    auto shape = getShape(ptr);
+    auto words = getWords(ptr);
+    auto tag = value.getTag();
 
-    assert (idxCache < cap);
-    auto nameSlot = values[idxCache];
-    if (nameSlot.isString())
+    // Remaining entries are transitions adding the field
+    auto entry = cache.find(shape, name, tag);
+    if (entry)
     {
-        auto nameSlotStr = String(nameSlot);
-        if (strcmp(nameSlotStr.getDataPtr(), name) == 0)
+        // Add the field if the object has room for it
+        if (entry->slotIdx < *(uint32_t*)(ptr + OF_CAP))
         {
-            //std::cout << "  cache hit" << std::endl;
-            value = values[idxCache + 1];
-            return true;
+            fieldCacheHits++;
+            setShape(ptr, entry->newShape);
+            words[entry->slotIdx] = value.getWord();
+            vm.writeBarrier(ptr, value);
+            return;
         }
     }
 
-    //std::cout << "cache miss" << std::endl;
-    //std::cout << "  name=" << name << std::endl;
-
+    fieldCacheMisses++;
 
-    size_t slotIdx = getSlotIdx(ptr, cap, String(name), false);
+    auto slotIdx = shape->getSlotIdx(name);
 
-    if (slotIdx >= cap)
+    if (slotIdx < shape->getNumFields())
     {
-        return false;
+        // Writing a value with another tag changes the shape. This
+        // is not cached, the next write will hit on the new shape.
+        if (shape->getFieldTag(slotIdx) != tag)
+            setShape(ptr, shape->setFieldTag(slotIdx, tag));
+        else if (name.isInterned())
+            cache.addEntry(shape, name, nullptr, slotIdx, tag);
+
+        words[slotIdx] = value.getWord();
+        vm.writeBarrier(ptr, value);
+        return;
     }
 
-    idxCache = slotIdx;
-
-    //std::cout << "  cache miss" << std::endl;
-    //std::cout << "  slotIdx=" << slotIdx << std::endl;
+    // The field is new, add it to the object
+    addField(name, value);
 
-    value = values[slotIdx + 1];
-    return true;
+    // Cache the transition, dictionary-mode shapes are
+    // extended in place and have no transitions
+    auto newShape = getShape(getObjPtr());
+    if (!newShape->isDictMode() && name.isInterned())
+        cache.addEntry(shape, name, newShape, slotIdx, tag);
 }
 
 ObjFieldItr::ObjFieldItr(Object obj)
@@ -539,42 +1750,19 @@ ObjFieldItr::ObjFieldItr(Object obj)
 
 bool ObjFieldItr::valid()
 {
-    //std::cout << "valid" << std::endl;
-
-    auto ptr = obj.getObjPtr();
-    auto cap = obj.getCap();
-    auto values = (Value*)(ptr + Object::OF_FIELDS);
-
-    return slotIdx < cap && values[slotIdx].isString();
+    auto shape = Object::getShape(obj.getObjPtr());
+    return slotIdx < shape->getNumFields();
 }
 
 std::string ObjFieldItr::get()
 {
-    auto ptr = obj.getObjPtr();
-    auto cap = obj.getCap();
-    auto values = (Value*)(ptr + Object::OF_FIELDS);
-
-    //std::cout << "cap=" << cap << std::endl;
-    //std::cout << "tag=" << (int)values[slotIdx].getTag() << std::endl;
-
-    assert (values[slotIdx].isString());
-
-    return values[slotIdx];
+    auto shape = Object::getShape(obj.getObjPtr());
+    return shape->getFieldName(slotIdx);
 }
 
 void ObjFieldItr::next()
 {
-    auto ptr = obj.getObjPtr();
-    auto cap = obj.getCap();
-    auto values = (Value*)(ptr + Object::OF_FIELDS);
-
-    slotIdx += 2;
-
-    if (slotIdx >= cap)
-        return;
-
-    if (values[slotIdx] == Value::UNDEF)
-        slotIdx = cap;
+    slotIdx++;
 }
 
 ImgRef::ImgRef(String symbol)
@@ -585,6 +1773,7 @@ ImgRef::ImgRef(String symbol)
 
     // Set the string pointer
     *(refptr*)(ptr + OF_SYM) = (refptr)symbol;
+    vm.writeBarrier(ptr, symbol);
 }
 
 ImgRef::ImgRef(Value val)
@@ -631,6 +1820,29 @@ void testRuntime()
 {
     std::cout << "runtime tests" << std::endl;
 
+    // Memory without a nursery owner is allocated in the
+    // old space, where freed blocks are reused zeroed
+    auto bytes = vm.allocated();
+    auto raw = vm.allocRaw(nullptr, 3 * sizeof(Word));
+    assert (vm.allocated() == bytes + 3 * sizeof(Word));
+    memset(raw, 0xFF, 3 * sizeof(Word));
+    vm.freeRaw(raw, 3 * sizeof(Word));
+    auto raw2 = vm.allocRaw(nullptr, 3 * sizeof(Word));
+    assert (raw2 == raw);
+    for (size_t i = 0; i < 3 * sizeof(Word); ++i)
+        assert (raw2[i] == 0);
+    vm.freeRaw(raw2, 3 * sizeof(Word));
+
+    // Allocation statistics, per tag and per size bucket
+    auto arrStats = vm.getTagStats(TAG_ARRAY);
+    auto bucketStats = vm.getSizeStats(2);
+    Array(2);
+    assert (roundSize(Array::memSize(2)) == 56);
+    assert (vm.getTagStats(TAG_ARRAY).count == arrStats.count + 1);
+    assert (vm.getTagStats(TAG_ARRAY).bytes == arrStats.bytes + 56);
+    assert (vm.getSizeStats(2).count == bucketStats.count + 1);
+    assert (vm.peakHeapSize() >= vm.heapSize());
+
     // Strings
     auto str = String("foobar");
     assert (str.length() == 6);
@@ -642,6 +1854,22 @@ void testRuntime()
     assert (str == str2);
     assert ((std::string)str == (std::string)str2);
 
+    // String interning
+    assert (str.isInterned());
+    assert ((refptr)str == (refptr)str2);
+    auto str3 = String::concat(String("foo"), String("bar"));
+    assert (!str3.isInterned());
+    assert (str3 == str);
+    assert ((refptr)String::intern(str3) == (refptr)str);
+    auto str4 = String("foo bar");
+    assert (!str4.isInterned());
+    assert (!(str4 == str));
+    assert (String::findInterned("foo bar", 7) == Value::UNDEF);
+    auto str5 = String::intern(str4);
+    assert (str5.isInterned());
+    assert (str5 == str4);
+    assert (String::findInterned("foo bar", 7) == (Value)str5);
+
     // Arrays
     auto arr = Array(2);
     assert (arr.length() == 0);
@@ -666,6 +1894,12 @@ void testRuntime()
     assert (arr2.length() == 2);
     assert (arr2.getElem(0) == Value::ONE);
     assert (arr2.getElem(1) == Value::TWO);
+    for (int64_t i = 2; i < 100; ++i)
+        arr2.push((i % 2)? Value(i):Value::TRUE);
+    assert (arr2.length() == 100);
+    assert (arr2.getElem(1) == Value::TWO);
+    assert (arr2.getElem(98) == Value::TRUE);
+    assert (arr2.getElem(99) == Value(99l));
 
     // Objects
     auto obj = Object::newObject();
@@ -686,6 +1920,185 @@ void testRuntime()
         fieldStr += itr.get();
     assert (fieldStr == "foobar");
 
+    // Shapes
+    auto obj2 = Object::newObject();
+    obj2.setField("foo", Value::FALSE);
+    obj2.setField("bar", Value::ONE);
+    assert (obj2.getField("bar") == Value::ONE);
+    FieldCache cache;
+    Value fieldVal;
+    assert (obj.getField(String("bar"), fieldVal, cache));
+    assert (fieldVal == Value::TWO);
+    assert (cache.numEntries == 1 && cache.entries[0].slotIdx == 1);
+    assert (obj2.getField(String("bar"), fieldVal, cache));
+    assert (fieldVal == Value::ONE);
+    assert (!obj2.hasField(String("baz"), cache));
+    assert (obj2.getField(String("foo"), fieldVal, cache));
+    assert (fieldVal == Value::FALSE);
+    assert (cache.numEntries == 2);
+
+    // Polymorphic field caches and set_field transitions
+    FieldCache setCache;
+    FieldCache getCache;
+    for (int64_t i = 0; i < 3; ++i)
+    {
+        auto obj3 = Object::newObject();
+        if (i == 1)
+            obj3.setField("a", Value::ONE);
+        obj3.setField(String("x"), Value(i), setCache);
+        assert (obj3.getField(String("x"), fieldVal, getCache));
+        assert (fieldVal == Value(i));
+    }
+    assert (setCache.numEntries == 2 && setCache.entries[0].newShape);
+    assert (getCache.numEntries == 2 && !getCache.megamorphic);
+
+    // Size classes
+    assert (Object::sizeClass(0) == 2);
+    assert (Object::sizeClass(3) == 3);
+    assert (Object::sizeClass(5) == 6);
+    assert (Object::sizeClass(7) == 8);
+    assert (Object::sizeClass(13) == 16);
+    assert (Object::sizeClass(17) == 24);
+
+    // Object literals
+    ObjLitCache litCache;
+    litCache.names = { String("a"), String("b") };
+    Value litVals[] = { Value::TRUE, Value::ONE };
+    auto lit = Object::newObject(litCache, litVals);
+    assert (lit.getField("a") == Value::ONE && lit.getField("b") == Value::TRUE);
+    lit = Object::newObject(litCache, litVals);
+    assert (lit.getField("a") == Value::ONE && litCache.numShapes == 1);
+    litVals[0] = Value::TWO;
+    lit = Object::newObject(litCache, litVals);
+    assert (lit.getField("b") == Value::TWO && litCache.numShapes == 2);
+    litCache = ObjLitCache();
+    litCache.names = { String("a"), String("a") };
+    litCache.repeatedNames = true;
+    lit = Object::newObject(litCache, litVals);
+    assert (lit.getField("a") == Value::TWO && litCache.numShapes == 0);
+
+    // Prototype chain lookups
+    auto proto = Object::newObject();
+    proto.setField("y", Value::TWO);
+    auto child = Object::newObject();
+    child.setField("proto", proto);
+    PropCache propCache;
+    assert (child.getProp(String("y"), fieldVal, propCache));
+    assert (fieldVal == Value::TWO && propCache.numShapes == 2);
+    assert (child.getProp(String("y"), fieldVal, propCache));
+    assert (fieldVal == Value::TWO);
+    child.setField("y", Value::ONE);
+    assert (child.getProp(String("y"), fieldVal, propCache));
+    assert (fieldVal == Value::ONE && propCache.numShapes == 1);
+    assert (!child.getProp(String("z"), fieldVal, propCache));
+
+    // Dictionary-mode objects
+    auto dict = Object::newObject();
+    for (int64_t i = 0; i < 1000; ++i)
+        dict.setField("k" + std::to_string(i), Value(i));
+    for (int64_t i = 999; i >= 0; --i)
+        assert (dict.getField("k" + std::to_string(i)) == Value(i));
+    assert (!dict.hasField("k1000"));
+    int64_t fieldIdx = 0;
+    for (auto itr = ObjFieldItr(dict); itr.valid(); itr.next())
+        assert (itr.get() == "k" + std::to_string(fieldIdx++));
+    assert (fieldIdx == 1000);
+
+    // Writing a value with another tag transitions the shape
+    auto objA = Object::newObject();
+    auto objB = Object::newObject();
+    objA.setField("p", Value::ONE);
+    objA.setField("q", Value::TWO);
+    objB.setField("p", Value::TRUE);
+    objB.setField("q", Value::TWO);
+    FieldCache tagCache;
+    objA.setField(String("p"), Value::FALSE, tagCache);
+    assert (objA.getField("p") == Value::FALSE);
+    assert (objA.getField("q") == Value::TWO);
+    objB.setField(String("p"), Value::TRUE, tagCache);
+    objB.setField(String("p"), Value::TRUE, tagCache);
+    assert (tagCache.numEntries == 1 && tagCache.entries[0].tag == TAG_BOOL);
+    FieldCache sameCache;
+    assert (objA.getField(String("q"), fieldVal, sameCache));
+    assert (objB.getField(String("q"), fieldVal, sameCache));
+    assert (sameCache.numEntries == 1 && fieldVal == Value::TWO);
+    dict.setField("k500", Value::TRUE);
+    assert (dict.getField("k500") == Value::TRUE);
+    assert (dict.getField("k501") == Value(501l));
+
+    // Garbage collection. This moves the objects created above.
+    {
+        auto gcObj = Object::newObject(1);
+        gcObj.setField("a", Value::ONE);
+        gcObj.setField("b", String("foo bar"));
+        auto gcArr = Array(0);
+        gcArr.push(gcObj);
+        gcArr.push(Value::TWO);
+        gcObj.setField("arr", gcArr);
+
+        HostRoot root(gcArr);
+        auto internedPtr = (refptr)String("foo");
+        for (size_t i = 0; i < 1000; ++i)
+            Object::newObject();
+
+        auto heapSize = vm.heapSize();
+        vm.collect();
+        assert (vm.heapSize() < heapSize);
+
+        // Grown objects and arrays are inlined in their copies
+        auto arrPtr = (refptr)Array(root.get());
+        assert (arrPtr != (refptr)gcArr);
+        assert (*(refptr*)(arrPtr + Array::OF_WORDS) == arrPtr + Array::OF_DATA);
+        auto arr = Array(root.get());
+        assert (arr.length() == 2);
+        assert (arr.getElem(1) == Value::TWO);
+        auto objPtr = (refptr)arr.getElem(0);
+        assert (*(refptr*)(objPtr + Object::OF_SLOTS) == objPtr + Object::OF_FIELDS);
+        auto obj = Object(arr.getElem(0));
+        assert (obj.getField("a") == Value::ONE);
+        assert ((std::string)obj.getField("b") == "foo bar");
+        assert (obj.getField("arr") == root.get());
+
+        // Interned strings never move
+        assert ((refptr)String("foo") == internedPtr);
+
+        // Young objects referenced only by an old object survive minor
+        // collections, found through the remembered set
+        assert (!vm.inNursery((refptr)obj));
+        auto young = Object::newObject();
+        young.setField("x", String::concat(String("a"), String("b")));
+        assert (vm.inNursery((refptr)young));
+        obj.setField("young", young);
+        arr.push(Array(1));
+        vm.collectNursery();
+        obj = Object(Array(root.get()).getElem(0));
+        assert ((refptr)obj == objPtr);
+        young = Object(obj.getField("young"));
+        assert (!vm.inNursery((refptr)young));
+        assert ((std::string)young.getField("x") == "ab");
+        auto arrElem = Array(root.get()).getElem(2);
+        assert (arrElem.isArray() && !vm.inNursery((refptr)arrElem));
+
+        // Major collections free the interned strings not reached,
+        // unless pinned. Dictionary-mode objects keep their names.
+        auto bigObj = Object::newObject();
+        for (int64_t i = 0; i < 40; ++i)
+            bigObj.setField("big" + std::to_string(i), Value(i));
+        obj.setField("big", bigObj);
+        String::intern(std::string("unreached"));
+        String::internPinned(String("pinned"));
+        vm.collect();
+        assert (String::findInterned("unreached", 9) == Value::UNDEF);
+        assert (String::findInterned("pinned", 6) != Value::UNDEF);
+        assert (String::findInterned("big39", 5) != Value::UNDEF);
+        obj = Object(Array(root.get()).getElem(0));
+        bigObj = Object(obj.getField("big"));
+        assert (bigObj.getField("big39") == Value(39l));
+        bigObj.setField("big39", Value::TRUE);
+        assert (bigObj.getField("big39") == Value::TRUE);
+        assert (bigObj.getField("big0") == Value(0l));
+    }
+
 
 
 
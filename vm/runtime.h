@@ -1,7 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
 #include <cstdint>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 /// Type tag, 8 bits
 typedef uint8_t Tag;
@@ -25,12 +30,32 @@ const Tag TAG_IMGREF    = 10;
 /// Object header size
 const size_t HEADER_SIZE = sizeof(intptr_t);
 
-/// Bit flag indicating the next pointer is set
-const size_t HEADER_IDX_NEXT = 15;
-const size_t HEADER_MSK_NEXT = 1 << HEADER_IDX_NEXT;
+/// Bit flag indicating a string is interned
+const size_t HEADER_IDX_INTERNED = 16;
+const size_t HEADER_MSK_INTERNED = 1 << HEADER_IDX_INTERNED;
 
-/// Offset of the next pointer
-const size_t OBJ_OF_NEXT = HEADER_SIZE;
+/// Interned strings store a hash of their contents in the
+/// upper half of the object header
+const size_t HEADER_IDX_HASH = 32;
+
+/// Bit flag indicating an object was copied by the collector,
+/// the new location being stored in the word after the header
+const size_t HEADER_IDX_FORWARDED = 17;
+const size_t HEADER_MSK_FORWARDED = 1 << HEADER_IDX_FORWARDED;
+
+/// Bit flag indicating an old object is in the remembered set
+const size_t HEADER_IDX_REMEMBERED = 18;
+const size_t HEADER_MSK_REMEMBERED = 1 << HEADER_IDX_REMEMBERED;
+
+/// Bit flag indicating an interned string is never collected
+const size_t HEADER_IDX_PINNED = 19;
+const size_t HEADER_MSK_PINNED = 1 << HEADER_IDX_PINNED;
+
+/// Bit flag marking the interned strings reached by a major collection
+const size_t HEADER_IDX_MARKED = 20;
+const size_t HEADER_MSK_MARKED = 1 << HEADER_IDX_MARKED;
+
+class Shape;
 
 /**
 64-bit word union
@@ -69,7 +94,7 @@ public:
     Value() : Value(FALSE.word, FALSE.tag) {}
     Value(int64_t v) : Value(Word(v), TAG_INT64) {}
     Value(refptr p, Tag t) : Value(Word(p), t) {}
-    Value(Word w, Tag t);
+    Value(Word w, Tag t) : word(w), tag(t) {}
     ~Value() {}
 
     bool isBool() const { return tag == TAG_BOOL; }
@@ -86,8 +111,18 @@ public:
 
     std::string toString() const;
 
-    operator bool () const;
-    operator int64_t () const;
+    operator bool () const
+    {
+        assert (tag == TAG_BOOL);
+        return word.int64? 1:0;
+    }
+
+    operator int64_t () const
+    {
+        assert (tag == TAG_INT64);
+        return word.int64;
+    }
+
     operator refptr () const;
     operator std::string () const;
 
@@ -104,18 +139,238 @@ public:
 
 /**
 Virtual Machine object (singleton)
+
+Heap objects are reclaimed by a precise, generational copying collector.
+New objects are allocated in a nursery by bumping a pointer. Minor
+collections copy the nursery objects still alive into the old space,
+which is made of chunks of memory, and then empty the nursery. Major
+collections copy all live objects into fresh chunks and release the old
+ones. Objects and arrays which outgrew their inline storage get their
+contents inlined again when copied.
+
+Old objects which are given a reference to a nursery object are added
+to a remembered set by the write barrier, so that minor collections
+need not scan the old space. Code storing values in heap objects must
+go through the Object and Array methods, or call writeBarrier.
+
+Collections only happen at safepoints, where every live reference is
+either in the heap or in a root known to the collector: the locations
+registered with addRoot, and those visited by the functions registered
+with addRootFn. Host code must not hold unregistered references across
+operations which may reach a safepoint, such as running plush code.
+
+Interned strings are allocated separately and never move, so that
+shapes and inline caches can refer to them by address. Major
+collections free the ones which were not reached, unless they are
+pinned. The field names of the shape tree and the constants of compiled
+code are pinned, so the names inline caches refer to stay valid.
+
+Dictionary-mode shapes belong to a single object, and are freed by the
+collection which finds that object dead.
 */
 class VM
 {
+public:
+
+    /// Function called during collections to forward the
+    /// references held outside of the heap
+    typedef void (*RootFn)();
+
+    /// Number of allocation size buckets. Bucket i counts blocks
+    /// of at most 16 << i bytes, and the last bucket all larger ones.
+    static const size_t NUM_SIZE_BUCKETS = 9;
+
+    /// Number and total size of allocated blocks
+    struct AllocStats
+    {
+        size_t count = 0;
+        size_t bytes = 0;
+    };
+
+    /// Function called on sampled allocations, with the number
+    /// of bytes allocated since the previous sample
+    typedef void (*AllocSampleFn)(size_t bytes);
+
 private:
 
-    // TODO: total memory size allocated
+    /// Size of the chunks the heap is made of
+    static const size_t CHUNK_SIZE = 1 << 22;
+
+    /// Blocks larger than this are allocated separately
+    static const size_t MAX_CHUNK_ALLOC = CHUNK_SIZE / 16;
+
+    /// Blocks of up to this many words are recycled
+    /// through per-size free lists
+    static const size_t MAX_SMALL_WORDS = 32;
+
+    /// Old space size below which no major collection is triggered
+    static const size_t MIN_HEAP_LIMIT = 1 << 25;
+
+    /// Size of the nursery
+    static const size_t NURSERY_SIZE = 1 << 20;
+
+    /// Blocks larger than this are allocated in the old space
+    static const size_t MAX_NURSERY_ALLOC = NURSERY_SIZE / 64;
+
+    /// Number of minor collections in stress mode per major collection
+    static const size_t STRESS_MAJOR_PERIOD = 16;
+
+    /// Upper bounds of the minor collection pause time
+    /// histogram buckets, in milliseconds
+    static const size_t NUM_PAUSE_BUCKETS = 10;
+    static const double PAUSE_BUCKETS[NUM_PAUSE_BUCKETS];
+
+    /// Memory space objects are allocated in
+    struct Space
+    {
+        /// Chunks allocated so far
+        std::vector<uint8_t*> chunks;
+
+        /// Blocks too large to fit in chunks
+        std::unordered_set<uint8_t*> largeBlocks;
+
+        /// Bump allocation pointer and limit in the current chunk
+        uint8_t* allocPtr = nullptr;
+        uint8_t* allocLimit = nullptr;
+
+        /// Number of bytes in use
+        size_t size = 0;
+
+        /// Release the memory of the space
+        void release();
+    };
+
+    /// Old space
+    Space heap;
+
+    /// Nursery memory, and bump allocation pointer in it
+    uint8_t* nurseryStart = nullptr;
+    uint8_t* nurseryPtr = nullptr;
+    uint8_t* nurseryLimit = nullptr;
+
+    /// Old objects which may refer to nursery objects
+    std::vector<refptr> rememberedSet;
+
+    /// Flag set when the nursery is full or the old space
+    /// reached its limit, so the next safepoint collects
+    bool gcPending = false;
+
+    /// Flag indicating a minor collection is in progress
+    bool minorGC = false;
+
+    /// Dictionary-mode shapes of nursery and old objects
+    std::vector<Shape*> youngDicts;
+    std::vector<Shape*> oldDicts;
+
+    /// Free lists of small blocks, indexed by size in words.
+    /// The first word of each free block points to the next one.
+    uint8_t* freeLists[MAX_SMALL_WORDS + 1];
+
+    /// Total number of bytes allocated, including freed blocks
+    size_t bytesAllocated = 0;
+
+    /// Total size of the interned strings. Only major collections
+    /// free them, so they count toward the limit triggering those.
+    size_t internedSize = 0;
+
+    /// Heap size at which the next collection happens
+    size_t gcLimit = MIN_HEAP_LIMIT;
+
+    /// Number of minor and major collections performed
+    size_t numMinorGCs = 0;
+    size_t numMajorGCs = 0;
+
+    /// Minor collection pause counts, per histogram bucket, the
+    /// last bucket counting pauses longer than all bounds
+    size_t pauseCounts[NUM_PAUSE_BUCKETS + 1] = {};
+
+    /// Total and longest minor and major collection pauses, in ms
+    double totalMinorPause = 0;
+    double maxMinorPause = 0;
+    double totalMajorPause = 0;
+    double maxMajorPause = 0;
+
+    /// Locations registered as roots
+    std::vector<Value*> roots;
+
+    /// Functions forwarding the references held by other subsystems
+    std::vector<RootFn> rootFns;
+
+    /// Objects copied during a collection whose
+    /// references remain to be forwarded
+    std::vector<refptr> copiedObjs;
+
+    /// Allocate a zeroed block of memory
+    uint8_t* allocBlock(Space& space, size_t size);
+
+    /// Allocate a zeroed block of memory in the nursery if it has
+    /// room, or else in the old space
+    uint8_t* allocYoung(size_t size);
+
+    /// Add an old object to the remembered set
+    void remember(refptr ptr);
+
+    /// Copy the objects reachable from the roots
+    void copyReachable();
+
+    /// Empty the nursery after its live objects were copied
+    void resetNursery();
+
+    /// Collect at a safepoint where a collection is pending
+    void collectPending();
+
+    /// Free the dictionary-mode shapes of the objects found dead. After
+    /// a major collection, mark the field names of the live ones.
+    void sweepDicts();
+
+    /// Free the interned strings a major collection did not reach
+    void sweepInterned();
+
+    /// Collect at every safepoint, to expose missing roots
+    bool stressMode = false;
+
+    /// Allocation statistics per object tag and per block size.
+    /// Copies made by the collector are not counted.
+    AllocStats tagStats[TAG_IMGREF + 1];
+    AllocStats sizeStats[NUM_SIZE_BUCKETS];
+
+    /// Allocation statistics for the storage of grown objects and arrays
+    AllocStats bufferStats;
 
-    // TODO: dynamically grow pools?
+    /// Largest heap size observed before a collection or release
+    size_t peakSize = 0;
 
-    // TODO: pools for sizes up to 32 (words)
+    /// Allocation sampling function and mean interval. The countdown
+    /// is the number of bytes left to allocate before the next sample,
+    /// out of a randomly drawn length.
+    AllocSampleFn sampleFn = nullptr;
+    size_t sampleInterval = 0;
+    int64_t sampleLength = INT64_MAX;
+    int64_t sampleCountdown = INT64_MAX;
+    uint64_t sampleRandState = 0x2545F4914F6CDD1D;
 
-    // TODO: number of elements allocated in each pool
+    /// Count an object allocation in the statistics
+    void countAlloc(size_t size, Tag tag);
+
+    /// Count allocated bytes towards the next sample
+    void countSample(size_t size)
+    {
+        sampleCountdown -= size;
+        if (sampleCountdown <= 0)
+            takeSample();
+    }
+
+    /// Call the sampling function and restart the countdown
+    void takeSample();
+
+    /// Draw the number of bytes until the next sample
+    int64_t nextSampleLength();
+
+    /// Copy an object to the heap being collected into
+    refptr copyObject(refptr ptr);
+
+    /// Forward the references held by a copied object
+    void scanObject(refptr ptr);
 
 public:
 
@@ -124,7 +379,122 @@ public:
     /// Allocate a block of memory on the heap
     Value alloc(uint32_t size, Tag tag);
 
-    size_t allocated() const;
+    /// Allocate a block of memory for an interned string
+    Value allocInterned(uint32_t size);
+
+    /// Release the memory of an interned string
+    void freeInterned(refptr ptr);
+
+    /// Allocate zeroed memory without an object header, used for
+    /// the storage of objects and arrays which grow past their
+    /// initial capacity. The memory is in the same generation as
+    /// the object it belongs to.
+    uint8_t* allocRaw(refptr owner, size_t size);
+
+    /// Release memory obtained from allocRaw
+    void freeRaw(uint8_t* ptr, size_t size);
+
+    /// Register the dictionary-mode shape of an object,
+    /// to be freed when the object dies
+    void addDictShape(refptr owner, Shape* shape);
+
+    /// Check if a block of memory is in the nursery
+    bool inNursery(const void* ptr) const
+    {
+        return (uintptr_t)((uint8_t*)ptr - nurseryStart) < NURSERY_SIZE;
+    }
+
+    /// Write barrier, called when a value is stored in an object or
+    /// array. The word is tested without looking at the tag, since
+    /// integers falling in the nursery range only cost a needless
+    /// remembered set entry.
+    void writeBarrier(refptr ptr, Value val)
+    {
+        if (inNursery(val.getWord().ptr) && !inNursery(ptr))
+            remember(ptr);
+    }
+
+    /// Get the total number of bytes allocated
+    size_t allocated() const { return bytesAllocated; }
+
+    /// Get the number of bytes in use in the heap
+    size_t heapSize() const { return heap.size + (nurseryPtr - nurseryStart); }
+
+    /// Get the number of collections performed so far
+    size_t getNumCollections() const { return numMinorGCs + numMajorGCs; }
+
+    /// Check if the collection in progress only collects the nursery
+    bool isMinorGC() const { return minorGC; }
+
+    /// Get the largest number of bytes in use in the heap so far
+    size_t peakHeapSize() const { return std::max(peakSize, heapSize()); }
+
+    /// Get the allocation statistics for objects with a given tag
+    const AllocStats& getTagStats(Tag tag) const
+    {
+        assert (tag < sizeof(tagStats) / sizeof(tagStats[0]));
+        return tagStats[tag];
+    }
+
+    /// Get the allocation statistics for a size bucket
+    const AllocStats& getSizeStats(size_t bucket) const
+    {
+        assert (bucket < NUM_SIZE_BUCKETS);
+        return sizeStats[bucket];
+    }
+
+    /// Get the allocation statistics for grown object and array storage
+    const AllocStats& getBufferStats() const { return bufferStats; }
+
+    /// Get the largest block size counted in a size bucket,
+    /// the last bucket having no limit
+    static size_t sizeBucketLimit(size_t bucket) { return 16 << bucket; }
+
+    /// Print heap allocation statistics
+    void printHeapStats() const;
+
+    /// Sample allocations, calling a function each time about
+    /// a given number of bytes have been allocated. Sampling points
+    /// are randomized so as not to align with periodic allocations.
+    void setAllocSampling(size_t interval, AllocSampleFn fn);
+
+    /// Register a location holding a value as a root. The value is
+    /// kept alive, and updated when the object it refers to moves.
+    void addRoot(Value* root);
+
+    /// Unregister a root location
+    void removeRoot(Value* root);
+
+    /// Register a function forwarding the references held
+    /// outside the heap, which is called on each collection
+    void addRootFn(RootFn rootFn);
+
+    /// Forward a reference during a collection, copying the object it
+    /// refers to if needed. Only to be called from root functions.
+    void forward(Value& val);
+    refptr forward(refptr ptr);
+
+    /// Collect at every safepoint, to expose missing roots in testing
+    void setStressMode(bool enable);
+
+    /// Collect garbage in the whole heap
+    void collect();
+
+    /// Collect garbage in the nursery only
+    void collectNursery();
+
+    /// Collect garbage if the nursery is full or the old space has
+    /// reached its size limit. Must only be called where all live
+    /// references are in roots.
+    void safepoint()
+    {
+        if (gcPending)
+            collectPending();
+    }
+
+    /// Print collection statistics, including a histogram
+    /// of minor collection pause times
+    void printGCStats() const;
 };
 
 /**
@@ -174,16 +544,9 @@ protected:
 
     Wrapper() {}
 
-    /// Set the next pointer for an object
-    void setNextPtr(refptr obj, refptr nextPtr);
-
-    /// Get the next pointer for an object
-    refptr getNextPtr(refptr obj, refptr notFound);
-
-    /// Get a pointer to the object, or its next pointer if set
-    /// Note: this method is necessary because objects may be
-    ///       extended through indirection.
-    refptr getObjPtr();
+    /// Get a pointer to the object. This is only valid until the
+    /// next collection, which may move the object.
+    refptr getObjPtr() const { return val.getWord().ptr; }
 
 public:
 
@@ -206,6 +569,15 @@ Note: strings are UTF-8 and null-terminated
 */
 class String : public Wrapper
 {
+private:
+
+    /// Allocate a new string object, without interning it,
+    /// optionally in the space of interned strings
+    static Value newString(const char* data, size_t len, bool interned = false);
+
+    /// Flag a string as interned and store its hash
+    static void setInterned(Value str);
+
 public:
 
     /// Offset and size of the length and data fields
@@ -219,6 +591,7 @@ public:
         return OF_DATA + (len + 1) * sizeof(char);
     }
 
+    /// Create a string, identifier-like strings are interned
     String(std::string str);
     String(Value value);
 
@@ -235,8 +608,31 @@ public:
     /// Comparison with a string literal
     bool operator == (const char* that) const;
 
-    // FIXME: temporary until string internsing is implemented
-    bool operator == (String that) { return (std::string)*this == (std::string)that; }
+    /// Comparison with another string. Distinct interned strings
+    /// always differ, so comparing two of them is a pointer compare.
+    bool operator == (String that) const;
+
+    /// Check if this string is interned
+    bool isInterned() const;
+
+    /// Get the hash of an interned string
+    uint32_t getHash() const;
+
+    /// Get the interned string with the same contents,
+    /// interning this string if there is none yet
+    static String intern(String str);
+    static String intern(std::string str);
+
+    /// Keep an interned string from being collected, for strings
+    /// which shapes or compiled code refer to by address
+    void pin();
+
+    /// Intern a string and pin it
+    static String internPinned(String str);
+
+    /// Find the interned string with the given contents,
+    /// returns undef if there is none
+    static Value findInterned(const char* data, size_t len);
 
     /// Get the ith character code
     char operator [] (size_t i);
@@ -247,24 +643,36 @@ public:
 
 /**
 Array value wrapper
-Note: arrays have a fixed length set at allocation time
+Elements are stored inline up to the capacity given at allocation time.
+Arrays which grow past it move their elements to a separately allocated
+buffer, which the word and tag pointers then refer to.
 */
 class Array : public Wrapper
 {
+    friend class VM;
+
 private:
 
     /// Get the array capacity
     /// Note: we want to avoid publicly exposing the array capacity
     size_t getCap();
 
+    /// Get the element words and tags of the array
+    static Word* getWords(refptr ptr) { return *(Word**)(ptr + OF_WORDS); }
+    static Tag* getTags(refptr ptr) { return *(Tag**)(ptr + OF_TAGS); }
+
 public:
 
     /// Offset and size of the fields
-    static const size_t OF_CAP = HEADER_SIZE;
-    static const size_t SZ_CAP = sizeof(uint32_t);
-    static const size_t OF_LEN = OF_CAP + SZ_CAP;
+    static const size_t OF_LEN = HEADER_SIZE;
     static const size_t SZ_LEN = sizeof(uint32_t);
-    static const size_t OF_DATA = OF_LEN + SZ_LEN;
+    static const size_t OF_CAP = OF_LEN + SZ_LEN;
+    static const size_t SZ_CAP = sizeof(uint32_t);
+    static const size_t OF_WORDS = OF_CAP + SZ_CAP;
+    static const size_t SZ_WORDS = sizeof(Word*);
+    static const size_t OF_TAGS = OF_WORDS + SZ_WORDS;
+    static const size_t SZ_TAGS = sizeof(Tag*);
+    static const size_t OF_DATA = OF_TAGS + SZ_TAGS;
 
     /// Compute the size of an object of this type
     static constexpr size_t memSize(size_t cap)
@@ -294,56 +702,333 @@ public:
     //static Array concat(Array a, Array b);
 };
 
+/**
+Object shape (hidden class)
+Shapes form a tree rooted at the empty shape, where each shape adds
+one field to its parent. Objects which had the same fields added in
+the same order share a shape, which maps field names to slot indices.
+Tree shapes are never freed. Objects with many fields switch to a
+dictionary-mode shape of their own, freed when the object dies.
+*/
+class Shape
+{
+    friend class VM;
+
+private:
+
+    /// Parent shape, null for the empty shape
+    Shape* parent;
+
+    /// Name of the field added by this shape, an interned string
+    Value fieldName;
+
+    /// Type tag of the field added by this shape
+    Tag fieldTag;
+
+    /// Number of fields in objects of this shape
+    uint32_t numFields;
+
+    /// Type tags of the fields, in slot order. Field values are
+    /// stored untagged in objects, so their tags live here.
+    std::vector<Tag> fieldTags;
+
+    /// Child shapes, indexed by the name and tag of the field they add
+    std::unordered_map<uintptr_t, Shape*> children;
+
+    /// Dictionary-mode shapes belong to a single object, and index
+    /// its fields with an open-addressing hash table. They are
+    /// extended and retagged in place rather than through transitions,
+    /// so inline caches never refer to them.
+    bool isDict = false;
+
+    /// Flag set on dictionary-mode shapes whose object a collection
+    /// found alive
+    bool marked = false;
+
+    /// Field names of dictionary-mode shapes, in slot order
+    std::vector<Value> dictNames;
+
+    /// Hash table of slot indices plus one, zero for empty entries
+    std::vector<uint32_t> dictIndex;
+
+    Shape(Shape* parent, Value fieldName, Tag fieldTag);
+
+    /// Create a dictionary-mode copy of a shape
+    Shape* toDict() const;
+
+    /// Add a field to a dictionary-mode shape
+    void dictAdd(Value fieldName, Tag fieldTag);
+
+    /// Get the shape resulting from adding a field with an interned name
+    Shape* addInterned(Value fieldName, Tag fieldTag);
+
+    /// Find the slot index of a field given its interned name
+    uint32_t getSlotIdx(refptr namePtr) const;
+
+public:
+
+    /// Number of fields past which objects switch to dictionary mode
+    static const uint32_t DICT_THRESHOLD = 32;
+
+    /// Get the shape of objects with no fields
+    static Shape* getEmpty();
+
+    /// Check if this shape is in dictionary mode
+    bool isDictMode() const { return isDict; }
+
+    /// Get the shape resulting from adding a field to this one.
+    /// Dictionary-mode shapes are updated in place.
+    Shape* addField(String fieldName, Tag fieldTag);
+
+    /// Get the shape resulting from changing the tag of a field.
+    /// Dictionary-mode shapes are updated in place.
+    Shape* setFieldTag(uint32_t slotIdx, Tag fieldTag);
+
+    /// Get the type tag of the field stored at a given slot index
+    Tag getFieldTag(uint32_t slotIdx) const { return fieldTags[slotIdx]; }
+
+    /// Find the slot index of a field, or return the field count
+    /// if objects of this shape do not have this field
+    uint32_t getSlotIdx(const char* name, size_t nameLen) const;
+    uint32_t getSlotIdx(String name) const;
+
+    /// Get the number of fields in objects of this shape
+    uint32_t getNumFields() const { return numFields; }
+
+    /// Get the name of the field stored at a given slot index
+    std::string getFieldName(uint32_t slotIdx) const;
+};
+
+/**
+Polymorphic inline cache for field accesses, mapping object shapes and
+field names to the slot index where a field is found. Field names are
+part of the key because they can be computed at run time. Sites which
+see more than NUM_ENTRIES shape/name pairs become megamorphic, and then
+use a global cache shared by all megamorphic sites.
+
+Entries also record the field's type tag, so that cached reads need
+not load it from the shape. Writes only hit entries whose tag matches
+the value written, since writing a value with another tag changes the
+object's shape.
+*/
+struct FieldCache
+{
+    static const size_t NUM_ENTRIES = 4;
+
+    struct Entry
+    {
+        /// Shape of the objects accessed
+        const Shape* shape;
+
+        /// Field name
+        refptr name;
+
+        /// For set_field transitions adding the field, the shape
+        /// after the field is added, otherwise null
+        Shape* newShape;
+
+        /// Slot index of the field
+        uint32_t slotIdx;
+
+        /// Type tag of the field, after the transition if any
+        Tag tag;
+    };
+
+    Entry entries[NUM_ENTRIES];
+
+    uint8_t numEntries = 0;
+
+    bool megamorphic = false;
+
+    /// Find the entry for a given shape and name, if any
+    const Entry* find(const Shape* shape, refptr name) const
+    {
+        if (megamorphic)
+            return findMega(shape, name);
+
+        for (size_t i = 0; i < numEntries; ++i)
+            if (entries[i].shape == shape && entries[i].name == name)
+                return &entries[i];
+
+        return nullptr;
+    }
+
+    /// Find the entry for writing a value with a given tag, if any
+    const Entry* find(const Shape* shape, refptr name, Tag tag) const
+    {
+        if (megamorphic)
+        {
+            auto entry = findMega(shape, name);
+            return (entry && entry->tag == tag)? entry:nullptr;
+        }
+
+        for (size_t i = 0; i < numEntries; ++i)
+            if (entries[i].shape == shape && entries[i].name == name && entries[i].tag == tag)
+                return &entries[i];
+
+        return nullptr;
+    }
+
+    /// Find an entry in the global megamorphic cache
+    static const Entry* findMega(const Shape* shape, refptr name);
+
+    /// Add an entry, going megamorphic if the cache is full
+    void addEntry(
+        const Shape* shape,
+        refptr name,
+        Shape* newShape,
+        uint32_t slotIdx,
+        Tag tag
+    );
+};
+
+/**
+Inline cache for property reads which walk the prototype chain. It
+records the shape of each object from the receiver up to the holder
+of the property, so that a shape change anywhere along the chain
+invalidates it.
+*/
+struct PropCache
+{
+    static const size_t MAX_DEPTH = 4;
+
+    /// Property name
+    refptr name = nullptr;
+
+    /// Number of objects on the chain, zero if the cache is empty
+    uint8_t numShapes = 0;
+
+    /// Shapes of the objects on the chain, ending with the holder
+    const Shape* shapes[MAX_DEPTH];
+
+    /// Slot index of the proto field in each object before the
+    /// holder, and of the property in the holder
+    uint32_t slots[MAX_DEPTH];
+
+    /// Type tag of the property in the holder
+    Tag tag;
+};
+
+/**
+Per-site cache for object literals. Literals with distinct field names
+always lay their fields out in order, so the shape of the objects they
+create only depends on the tags of the field values. The cache holds
+the shapes for up to NUM_SHAPES combinations of tags seen at the site.
+*/
+struct ObjLitCache
+{
+    static const size_t NUM_SHAPES = 4;
+
+    /// Interned field names, in slot order
+    std::vector<Value> names;
+
+    /// Flag indicating that some field name is repeated, in which
+    /// case the values are added one by one and nothing is cached
+    bool repeatedNames = false;
+
+    /// Shapes of the objects created
+    Shape* shapes[NUM_SHAPES];
+
+    uint8_t numShapes = 0;
+
+    /// Index of the next entry to replace once the cache is full
+    uint8_t nextShape = 0;
+};
+
 /**
 Object value wrapper
 */
 class Object : public Wrapper
 {
     friend class ObjFieldItr;
+    friend class VM;
 
     /// Get the object's capacity
     size_t getCap();
 
-    /// Find the slot index at which a field is stored
-    size_t getSlotIdx(
+    /// Get the shape of the object
+    static Shape* getShape(refptr ptr)
+    {
+        return *(Shape**)(ptr + OF_SHAPE);
+    }
+
+    /// Set the shape of the object
+    static void setShape(refptr ptr, Shape* shape)
+    {
+        *(Shape**)(ptr + OF_SHAPE) = shape;
+    }
+
+    /// Get the untagged field values of the object
+    static Word* getWords(refptr ptr)
+    {
+        return *(Word**)(ptr + OF_SLOTS);
+    }
+
+    /// Find the slot index and type tag of a field, trying the
+    /// field cache first
+    uint32_t getSlotIdx(
         refptr ptr,
-        size_t cap,
         String fieldName,
-        bool newField
+        FieldCache& cache,
+        Tag& tag
     );
 
+    /// Add a new field, extending the object if needed
+    void addField(String name, Value value);
+
 public:
 
-    /// Minimum guaranteed object capacity
-    static const size_t MIN_CAP = 16;
+    /// Capacity of objects allocated without a field count
+    static const size_t DEFAULT_CAP = 4;
 
-    /// Offset and size of the fields
-    static const size_t OF_CAP = HEADER_SIZE;
-    static const size_t SZ_CAP = sizeof(uint32_t);
-    static const size_t OF_SHAPE = OF_CAP + SZ_CAP;
+    /// Offset and size of the fields. Field values are stored inline
+    /// up to the capacity given at allocation time, and the slots
+    /// pointer refers to them. Objects which grow past it move their
+    /// fields to a separately allocated buffer.
+    static const size_t OF_SHAPE = HEADER_SIZE;
     static const size_t SZ_SHAPE = sizeof(refptr);
-    static const size_t OF_FIELDS = OF_SHAPE + SZ_SHAPE;
+    static const size_t OF_SLOTS = OF_SHAPE + SZ_SHAPE;
+    static const size_t SZ_SLOTS = sizeof(Word*);
+    static const size_t OF_CAP = OF_SLOTS + SZ_SLOTS;
+    static const size_t SZ_CAP = sizeof(uint64_t); // uint32_t, padded
+    static const size_t OF_FIELDS = OF_CAP + SZ_CAP;
 
     /// Compute the size of an object of this type
     static constexpr size_t memSize(size_t cap)
     {
-        // FIXME: for now, we store tagged values, this will change
-        // once we have proper shapes implemented
-        //return OF_FIELDS + cap * sizeof(Word);
-        return OF_FIELDS + cap * sizeof(Value);
+        // Field values are stored untagged, in slot order,
+        // and their tags are kept in the object's shape
+        return OF_FIELDS + cap * sizeof(Word);
     }
 
-    /// Allocate a new empty object
+    /// Get the smallest size class holding a number of fields
+    static size_t sizeClass(size_t numFields);
+
+    /// Allocate a new empty object with room for a number of fields
     static Object newObject(size_t cap = 0);
 
+    /// Allocate an object literal, populated from values on the VM
+    /// stack. The stack grows down, so the last field's value comes
+    /// first.
+    static Object newObject(ObjLitCache& cache, const Value* stackVals);
+
     Object(Value value);
 
     bool hasField(String name);
     void setField(String name, Value val);
     Value getField(String name);
 
-    /// Property lookup with a slot index cache
-    bool getField(const char* name, Value& value, size_t& idxCache);
+    /// Property read walking the prototype chain, with a property cache
+    bool getProp(String name, Value& value, PropCache& cache);
+
+    /// Field accessors with a per-site field cache
+    bool hasField(String name, FieldCache& cache);
+    bool getField(String name, Value& value, FieldCache& cache);
+    void setField(String name, Value value, FieldCache& cache);
+
+    /// Overwrite a field already present with the same tag, if the
+    /// cache has an entry for it. Returns false otherwise.
+    bool setFieldCached(String name, Value value, FieldCache& cache);
 
     bool hasField(std::string name) { return hasField(String(name)); }
     void setField(std::string name, Value val) { return setField(String(name), val); }
@@ -359,7 +1044,7 @@ private:
 
     Object obj;
 
-    size_t slotIdx = 0;
+    uint32_t slotIdx = 0;
 
 public:
 
@@ -394,6 +1079,41 @@ public:
 /// Global virtual machine instance
 extern VM vm;
 
+/**
+Value held by host code across operations which may trigger a
+collection. It is registered as a root for the lifetime of this object.
+*/
+class HostRoot
+{
+private:
+
+    Value val;
+
+public:
+
+    HostRoot(Value val) : val(val) { vm.addRoot(&this->val); }
+    ~HostRoot() { vm.removeRoot(&this->val); }
+
+    HostRoot(const HostRoot&) = delete;
+    HostRoot& operator = (const HostRoot&) = delete;
+
+    /// Get the current value
+    Value get() const { return val; }
+};
+
+/// Field cache hit/miss counts for field accesses
+extern size_t fieldCacheHits;
+extern size_t fieldCacheMisses;
+
+/// Property cache hit/miss counts for property reads
+extern size_t propCacheHits;
+extern size_t propCacheMisses;
+
+/// Number of monomorphic, polymorphic and megamorphic field caches
+extern size_t monoFieldSites;
+extern size_t polyFieldSites;
+extern size_t megaFieldSites;
+
 /// Check if a string is a valid identifier
 bool isValidIdent(std::string identStr);
 